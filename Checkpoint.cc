@@ -0,0 +1,120 @@
+#include "Checkpoint.hh"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <initializer_list>
+
+namespace {
+    constexpr char fileMagic[4] = {'L', 'C', 'K', 'P'};
+    constexpr std::int32_t fileVersion = 1;
+
+    // Header fields after the magic, as 32-bit integers
+    enum Field { VERSION, METHOD, ITERATION, ITERATIONS, BOUNDARY, FORWARD, ADJOINT, KERNEL_WIDTH, KERNEL_HEIGHT,
+                 CHANNELS, WIDTH, HEIGHT, FIELDS };
+
+    // Product of the factors times size, or false if it exceeds limit; checked factor by factor so that
+    // sizes read from a damaged header cannot overflow it
+    bool boundedProduct(std::initializer_list<std::uint64_t> factors, std::uint64_t size, std::uint64_t limit,
+                        std::uint64_t& product) {
+        product = size;
+        for (std::uint64_t factor : factors) {
+            if (factor != 0 && product > limit / factor) {
+                return false;
+            }
+            product *= factor;
+        }
+        return product <= limit;
+    }
+}
+
+// On-disk layout: magic, the header fields, lambda, alpha and scalingFactor as doubles, the kernel entries
+// column by column, then the channels one after the other, row by row
+bool Checkpoint::save(const std::string& path) const {
+    std::int32_t header[FIELDS] = {};
+    header[VERSION] = fileVersion;
+    header[METHOD] = method;
+    header[ITERATION] = iteration;
+    header[ITERATIONS] = iterations;
+    header[BOUNDARY] = boundary;
+    header[FORWARD] = forwardAlgorithm;
+    header[ADJOINT] = adjointAlgorithm;
+    header[KERNEL_WIDTH] = kernel.size();
+    header[KERNEL_HEIGHT] = kernel.empty() ? 0 : kernel[0].size();
+    header[CHANNELS] = channels.size();
+    header[WIDTH] = channels.empty() ? 0 : channels[0].width;
+    header[HEIGHT] = channels.empty() ? 0 : channels[0].height;
+    const double parameters[3] = {lambda, alpha, scalingFactor};
+
+    // The temporary file is removed if it could not be written or renamed
+    std::string temporary = path + ".tmp";
+    bool written;
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file.write(fileMagic, 4);
+        file.write(reinterpret_cast<const char*>(header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(parameters), sizeof(parameters));
+        for (const auto& column : kernel) {
+            file.write(reinterpret_cast<const char*>(column.data()), column.size() * sizeof(double));
+        }
+        for (const auto& channel : channels) {
+            file.write(reinterpret_cast<const char*>(channel.data.data()), channel.size() * sizeof(double));
+        }
+        written = static_cast<bool>(file.flush());
+    }
+    if (!written || std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Checkpoint::load(const std::string& path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    const std::streamoff fileBytes = file.tellg();
+    file.seekg(0);
+    char magic[4];
+    std::int32_t header[FIELDS];
+    double parameters[3];
+    if (!file.read(magic, 4) || std::memcmp(magic, fileMagic, 4) != 0 ||
+        !file.read(reinterpret_cast<char*>(header), sizeof(header)) || header[VERSION] != fileVersion ||
+        header[KERNEL_WIDTH] < 0 || header[KERNEL_HEIGHT] < 0 || header[CHANNELS] < 0 || header[WIDTH] < 0 ||
+        header[HEIGHT] < 0 || !file.read(reinterpret_cast<char*>(parameters), sizeof(parameters))) {
+        return false;
+    }
+
+    // The kernel and the channels the header describes must fill the rest of the file exactly, which is
+    // checked before they are allocated
+    const std::uint64_t payload = static_cast<std::uint64_t>(fileBytes) - (4 + sizeof(header) + sizeof(parameters));
+    std::uint64_t kernelBytes, channelBytes;
+    if (!boundedProduct({static_cast<std::uint64_t>(header[KERNEL_WIDTH]), static_cast<std::uint64_t>(header[KERNEL_HEIGHT])},
+                        sizeof(double), payload, kernelBytes) ||
+        !boundedProduct({static_cast<std::uint64_t>(header[CHANNELS]), static_cast<std::uint64_t>(header[WIDTH]),
+                         static_cast<std::uint64_t>(header[HEIGHT])},
+                        sizeof(double), payload, channelBytes) ||
+        kernelBytes + channelBytes != payload) {
+        return false;
+    }
+
+    method = header[METHOD];
+    iteration = header[ITERATION];
+    iterations = header[ITERATIONS];
+    boundary = header[BOUNDARY];
+    forwardAlgorithm = header[FORWARD];
+    adjointAlgorithm = header[ADJOINT];
+    lambda = parameters[0];
+    alpha = parameters[1];
+    scalingFactor = parameters[2];
+    kernel.assign(header[KERNEL_WIDTH], std::vector<double>(header[KERNEL_HEIGHT]));
+    for (auto& column : kernel) {
+        if (!file.read(reinterpret_cast<char*>(column.data()), column.size() * sizeof(double))) {
+            return false;
+        }
+    }
+    channels.assign(header[CHANNELS], ImagePlane(header[WIDTH], header[HEIGHT]));
+    for (auto& channel : channels) {
+        if (!file.read(reinterpret_cast<char*>(channel.data.data()), channel.size() * sizeof(double))) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,812 @@
+#include "Convolution.hh"
+#include "FFT.hh"
+#include "ParallelUtils.hh"
+#include "PsfSpectrumCache.hh"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+    // Kernel extent along x (number of rows of the [x][y] kernel) and along y
+    int kernelWidth(const std::vector<std::vector<double>>& kernel) {
+        return static_cast<int>(kernel.size());
+    }
+
+    int kernelHeight(const std::vector<std::vector<double>>& kernel) {
+        return kernel.empty() ? 0 : static_cast<int>(kernel[0].size());
+    }
+
+    // Rows per parallel strip, so that small images are not split into tiny tasks
+    constexpr std::size_t minStripRows = 8;
+
+    // Index of the pixel read at position i of a line of n pixels under a mirror or replicate boundary
+    int boundaryIndex(int i, int n, Convolution::Boundary boundary) {
+        if (boundary == Convolution::Boundary::REPLICATE || n == 1) {
+            return std::clamp(i, 0, n - 1);
+        }
+        const int period = 2 * (n - 1);
+        i = (i % period + period) % period;
+        return i < n ? i : period - i;
+    }
+
+    // Raised cosine weight of a pixel distance pixels outside the image, over a margin of margin pixels
+    double taperWeight(int distance, int margin) {
+        return distance <= 0 ? 1.0 : 0.5 * (1.0 + std::cos(M_PI * distance / (margin + 1)));
+    }
+
+    // Transform time of a width x height 2D FFT: a row transform per row and a column transform per column
+    double transformCost(int width, int height) {
+        return height * FFT::estimatedCost(width) + width * FFT::estimatedCost(height);
+    }
+}
+
+void Convolution::correlate(const ImagePlane& in, ImagePlane& out, const std::vector<std::vector<double>>& kernel,
+                            int anchorX, int anchorY, Algorithm algorithm, Boundary boundary) {
+    Workspace workspace;
+    correlate(in, out, kernel, anchorX, anchorY, workspace, algorithm, boundary);
+}
+
+void Convolution::correlate(const ImagePlane& in, ImagePlane& out, const std::vector<std::vector<double>>& kernel,
+                            int anchorX, int anchorY, Workspace& workspace, Algorithm algorithm, Boundary boundary,
+                            const Layout& layout) {
+    out.resize(in.width, in.height);
+    if (in.size() == 0) {
+        return;
+    }
+    if (boundary != Boundary::ZERO) {
+        // Every tap of every output pixel lands inside the padded plane, so its zeros are never read
+        const int left = std::max(anchorX, 0);
+        const int top = std::max(anchorY, 0);
+        ImagePlane& extended = workspace.extended;
+        ImagePlane& extendedOut = workspace.extendedOut;
+        pad(in, extended, left, top, std::max(kernelWidth(kernel) - 1 - anchorX, 0),
+            std::max(kernelHeight(kernel) - 1 - anchorY, 0), boundary);
+        correlate(extended, extendedOut, kernel, anchorX, anchorY, workspace, algorithm, Boundary::ZERO, layout);
+        for (int y = 0; y < in.height; y++) {
+            std::copy_n(extendedOut.row(y + top) + left, in.width, out.row(y));
+        }
+        return;
+    }
+    if (algorithm == Algorithm::AUTO) {
+        algorithm = chooseAlgorithm(in.width, in.height, kernel);
+    }
+
+    std::vector<double> weightsX, weightsY;
+    if (algorithm == Algorithm::SEPARABLE && !separate(kernel, weightsX, weightsY)) {
+        algorithm = Algorithm::DIRECT;
+    }
+
+    switch (algorithm) {
+        case Algorithm::SPARSE:
+            correlate(in, out, SparseKernel::fromDense(kernel, anchorX, anchorY));
+            break;
+        case Algorithm::SEPARABLE:
+            correlateSeparable(in, out, weightsX, weightsY, anchorX, anchorY, workspace.vertical);
+            break;
+        case Algorithm::WINOGRAD:
+            if (kernelWidth(kernel) == 3 && kernelHeight(kernel) == 3 && anchorX == 1 && anchorY == 1) {
+                correlateWinograd(in, out, kernel);
+            } else {
+                correlateDirect(in, out, kernel, anchorX, anchorY);
+            }
+            break;
+        case Algorithm::BLOCKED:
+            if (layout.blockColumns == 4) {
+                correlateBlocked<4>(in, out, kernel, anchorX, anchorY, workspace.padded);
+            } else if (layout.blockColumns == 16) {
+                correlateBlocked<16>(in, out, kernel, anchorX, anchorY, workspace.padded);
+            } else {
+                correlateBlocked<blockColumns>(in, out, kernel, anchorX, anchorY, workspace.padded);
+            }
+            break;
+        case Algorithm::FFT:
+            correlateFFT(in, out, kernel, anchorX, anchorY, layout);
+            break;
+        default:
+            if (!correlateFixed(in, out, kernel, anchorX, anchorY)) {
+                correlateDirect(in, out, kernel, anchorX, anchorY);
+            }
+            break;
+    }
+}
+
+bool Convolution::correlateFixed(const ImagePlane& in, ImagePlane& out, const std::vector<std::vector<double>>& kernel,
+                                 int anchorX, int anchorY) {
+    int size = kernelWidth(kernel);
+    if (kernelHeight(kernel) != size || anchorX != size / 2 || anchorY != size / 2) {
+        return false;
+    }
+    switch (size) {
+        case 3:
+            correlateFixedSize<3>(in, out, kernel);
+            return true;
+        case 5:
+            correlateFixedSize<5>(in, out, kernel);
+            return true;
+        case 7:
+            correlateFixedSize<7>(in, out, kernel);
+            return true;
+        case 9:
+            correlateFixedSize<9>(in, out, kernel);
+            return true;
+        default:
+            return false;
+    }
+}
+
+template <int K>
+void Convolution::correlateFixedSize(const ImagePlane& in, ImagePlane& out, const std::vector<std::vector<double>>& kernel) {
+    constexpr int radius = K / 2;
+    const int width = in.width;
+    const int height = in.height;
+
+    std::array<double, K * K> weights;
+    for (int i = 0; i < K; i++) {
+        for (int j = 0; j < K; j++) {
+            weights[i * K + j] = kernel[i][j];
+        }
+    }
+    // Rows outside the image read as zeros, so every interior pixel takes the same unrolled path
+    std::vector<double> zeros(width, 0.0);
+
+    ParallelUtils::forStrips(0, height, [&](std::size_t rowBegin, std::size_t rowEnd) {
+        for (int y = rowBegin; y < static_cast<int>(rowEnd); y++) {
+            double* outRow = out.row(y);
+            std::array<const double*, K> rows;
+            for (int j = 0; j < K; j++) {
+                int yj = y + j - radius;
+                rows[j] = yj >= 0 && yj < height ? in.row(yj) : zeros.data();
+            }
+
+            // Columns whose taps leave the row skip the missing ones, like the dense loop
+            auto border = [&](int x) {
+                double sum = 0.0;
+                for (int i = 0; i < K; i++) {
+                    int xi = x + i - radius;
+                    if (xi < 0 || xi >= width) {
+                        continue;
+                    }
+                    for (int j = 0; j < K; j++) {
+                        sum += rows[j][xi] * weights[i * K + j];
+                    }
+                }
+                return sum;
+            };
+
+            int interiorBegin = std::min(radius, width);
+            int interiorEnd = std::max(interiorBegin, width - radius);
+            for (int x = 0; x < interiorBegin; x++) {
+                outRow[x] = border(x);
+            }
+            // Taps in kernel order, so the sums match the dense loop bit for bit
+            for (int x = interiorBegin; x < interiorEnd; x++) {
+                double sum = 0.0;
+                for (int i = 0; i < K; i++) {
+                    for (int j = 0; j < K; j++) {
+                        sum += rows[j][x + i - radius] * weights[i * K + j];
+                    }
+                }
+                outRow[x] = sum;
+            }
+            for (int x = interiorEnd; x < width; x++) {
+                outRow[x] = border(x);
+            }
+        }
+    }, minStripRows);
+}
+
+Convolution::Algorithm Convolution::chooseAlgorithm(int width, int height, const std::vector<std::vector<double>>& kernel) {
+    double entries = static_cast<double>(kernelWidth(kernel)) * kernelHeight(kernel);
+
+    // The best of the direct sums: the tap list for sparse kernels, the unrolled or generic dense loop, or
+    // register blocks for large dense kernels without a fixed-size loop
+    Algorithm local = Algorithm::DIRECT;
+    if (estimatedCost(Algorithm::SPARSE, width, height, kernel) < sparseDensity * entries) {
+        local = Algorithm::SPARSE;
+    } else if (!isFixedSize(kernel) && entries >= blockedMinTaps) {
+        local = Algorithm::BLOCKED;
+    }
+    double localCost = estimatedCost(local, width, height, kernel);
+    double separableCost = estimatedCost(Algorithm::SEPARABLE, width, height, kernel);
+    double fftCost = estimatedCost(Algorithm::FFT, width, height, kernel);
+
+    if (fftCost < std::min(localCost, separableCost)) {
+        return Algorithm::FFT;
+    }
+    if (separableCost < localCost) {
+        return Algorithm::SEPARABLE;
+    }
+    return local;
+}
+
+double Convolution::estimatedCost(Algorithm algorithm, int width, int height, const std::vector<std::vector<double>>& kernel) {
+    int kw = kernelWidth(kernel);
+    int kh = kernelHeight(kernel);
+    double entries = static_cast<double>(kw) * kh;
+    std::vector<double> weightsX, weightsY;
+
+    switch (algorithm) {
+        case Algorithm::SPARSE: {
+            // The tap list only walks the non-zero entries
+            double taps = 0.0;
+            for (const auto& column : kernel) {
+                taps += std::count_if(column.begin(), column.end(), [](double w) { return w != 0.0; });
+            }
+            return taps;
+        }
+        case Algorithm::DIRECT:
+            // Measured: the unrolled loops take about a third of the time of the generic one per tap
+            return isFixedSize(kernel) ? 0.35 * entries : entries;
+        case Algorithm::BLOCKED:
+            // Measured on 1024x768: register blocks run 1.2 to 1.5 times faster than the row loop from 11x11
+            // on, and stay ahead of the FFT up to about 35x35
+            return 0.7 * entries;
+        case Algorithm::WINOGRAD:
+            // Measured at about twice the unrolled 3x3 loop
+            return kw == 3 && kh == 3 ? 2.0 * 0.35 * entries : std::numeric_limits<double>::infinity();
+        case Algorithm::SEPARABLE:
+            // The separable passes also pay for writing and reading back an intermediate plane
+            return separate(kernel, weightsX, weightsY) ? kw + kh + 4 : std::numeric_limits<double>::infinity();
+        case Algorithm::FFT: {
+            // Padded complex transforms plus the spectrum product, spread over the pixels. The factor was
+            // measured against the vectorized direct loop: on a 1024x768 image they break even around 31x31.
+            const FFTPadding padding = fftPadding(width, height, kw, kh);
+            return 16.0 * transformCost(padding.paddedWidth, padding.paddedHeight) / (static_cast<double>(width) * height);
+        }
+        default:
+            return estimatedCost(chooseAlgorithm(width, height, kernel), width, height, kernel);
+    }
+}
+
+bool Convolution::isFixedSize(const std::vector<std::vector<double>>& kernel) {
+    int size = kernelWidth(kernel);
+    return kernelHeight(kernel) == size && std::find(fixedSizes.begin(), fixedSizes.end(), size) != fixedSizes.end();
+}
+
+Convolution::SparseKernel Convolution::SparseKernel::fromDense(const std::vector<std::vector<double>>& kernel,
+                                                              int anchorX, int anchorY) {
+    SparseKernel sparse;
+    for (int i = 0; i < kernelWidth(kernel); i++) {
+        for (int j = 0; j < kernelHeight(kernel); j++) {
+            if (kernel[i][j] != 0.0) {
+                sparse.taps.push_back({i - anchorX, j - anchorY, kernel[i][j]});
+            }
+        }
+    }
+    return sparse;
+}
+
+void Convolution::correlate(const ImagePlane& in, ImagePlane& out, const SparseKernel& kernel) {
+    const int width = in.width;
+    const int height = in.height;
+    out.resize(width, height);
+
+    // Same row loop as the dense path, but a long thin kernel costs one pass per tap instead of
+    // one per kernel entry
+    ParallelUtils::forStrips(0, height, [&](std::size_t rowBegin, std::size_t rowEnd) {
+        for (int y = rowBegin; y < static_cast<int>(rowEnd); y++) {
+            double* outRow = out.row(y);
+            std::fill(outRow, outRow + width, 0.0);
+            for (const auto& tap : kernel.taps) {
+                int yj = y + tap.dy;
+                if (yj < 0 || yj >= height) {
+                    continue;
+                }
+                const double* inRow = in.row(yj);
+                for (int x = std::max(0, -tap.dx); x < std::min(width, width - tap.dx); x++) {
+                    outRow[x] += inRow[x + tap.dx] * tap.weight;
+                }
+            }
+        }
+    }, minStripRows);
+}
+
+bool Convolution::separate(const std::vector<std::vector<double>>& kernel, std::vector<double>& weightsX,
+                           std::vector<double>& weightsY) {
+    int kw = kernelWidth(kernel);
+    int kh = kernelHeight(kernel);
+    if (kw == 0 || kh == 0) {
+        return false;
+    }
+
+    // Use the largest entry as pivot: kernel[i][j] = kernel[i][q] * kernel[p][j] / kernel[p][q]
+    int p = 0, q = 0;
+    double largest = 0.0;
+    for (int i = 0; i < kw; i++) {
+        for (int j = 0; j < kh; j++) {
+            if (std::abs(kernel[i][j]) > largest) {
+                largest = std::abs(kernel[i][j]);
+                p = i;
+                q = j;
+            }
+        }
+    }
+    if (largest == 0.0) {
+        return false;
+    }
+
+    weightsX.resize(kw);
+    weightsY.resize(kh);
+    for (int i = 0; i < kw; i++) {
+        weightsX[i] = kernel[i][q];
+    }
+    for (int j = 0; j < kh; j++) {
+        weightsY[j] = kernel[p][j] / kernel[p][q];
+    }
+    for (int i = 0; i < kw; i++) {
+        for (int j = 0; j < kh; j++) {
+            if (std::abs(kernel[i][j] - weightsX[i] * weightsY[j]) > 1e-12 * largest) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void Convolution::correlateWinograd(const ImagePlane& in, ImagePlane& out, const std::vector<std::vector<double>>& kernel) {
+    const int width = in.width;
+    const int height = in.height;
+    const int tilesX = (width + 1) / 2;
+    const int tilesY = (height + 1) / 2;
+
+    // Filter transform U = G g G^T, done once; g is indexed [x][y] like the kernel
+    const double G[4][3] = {{1.0, 0.0, 0.0}, {0.5, 0.5, 0.5}, {0.5, -0.5, 0.5}, {0.0, 0.0, 1.0}};
+    double U[4][4];
+    for (int a = 0; a < 4; a++) {
+        for (int b = 0; b < 4; b++) {
+            double sum = 0.0;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    sum += G[a][i] * kernel[i][j] * G[b][j];
+                }
+            }
+            U[a][b] = sum;
+        }
+    }
+    std::vector<double> zeros(width, 0.0);
+
+    // Each tile row covers output rows y0 and y0 + 1 and reads input rows y0 - 1 .. y0 + 2. The input
+    // transform along y combines whole rows into four transformed rows, padded with a zero column on the
+    // left and zeros past the right border; the rest of the tile runs on scalars held in registers.
+    ParallelUtils::forStrips(0, tilesY, [&](std::size_t tileRowBegin, std::size_t tileRowEnd) {
+        const int padded = 2 * tilesX + 2;
+        std::vector<double> transformed(4 * padded, 0.0);
+        double* T[4] = {transformed.data() + 1, transformed.data() + padded + 1,
+                        transformed.data() + 2 * padded + 1, transformed.data() + 3 * padded + 1};
+        std::vector<double> scratch(width + 1);
+
+        for (int tileY = tileRowBegin; tileY < static_cast<int>(tileRowEnd); tileY++) {
+            const int y0 = 2 * tileY;
+            const double* rows[4];
+            for (int b = 0; b < 4; b++) {
+                int y = y0 - 1 + b;
+                rows[b] = y >= 0 && y < height ? in.row(y) : zeros.data();
+            }
+
+            // B^T along y
+            for (int x = 0; x < width; x++) {
+                T[0][x] = rows[0][x] - rows[2][x];
+                T[1][x] = rows[1][x] + rows[2][x];
+                T[2][x] = rows[2][x] - rows[1][x];
+                T[3][x] = rows[1][x] - rows[3][x];
+            }
+
+            // B^T along x, the 16 products, and A^T along x then y. Whole tiles are written straight into
+            // the output rows; a missing second row goes to scratch and a last half tile is written apart.
+            double* outRow0 = out.row(y0);
+            double* outRow1 = y0 + 1 < height ? out.row(y0 + 1) : scratch.data();
+            auto tile = [&](int t, double& y00, double& y10, double& y01, double& y11) {
+                const int x0 = 2 * t;
+                double P0[4], P1[4];
+                for (int b = 0; b < 4; b++) {
+                    double d0 = T[b][x0 - 1];
+                    double d1 = T[b][x0];
+                    double d2 = T[b][x0 + 1];
+                    double d3 = T[b][x0 + 2];
+                    double m0 = U[0][b] * (d0 - d2);
+                    double m1 = U[1][b] * (d1 + d2);
+                    double m2 = U[2][b] * (d2 - d1);
+                    double m3 = U[3][b] * (d1 - d3);
+                    P0[b] = m0 + m1 + m2;
+                    P1[b] = m1 - m2 - m3;
+                }
+                y00 = P0[0] + P0[1] + P0[2];
+                y01 = P0[1] - P0[2] - P0[3];
+                y10 = P1[0] + P1[1] + P1[2];
+                y11 = P1[1] - P1[2] - P1[3];
+            };
+            const int wholeTiles = width / 2;
+            for (int t = 0; t < wholeTiles; t++) {
+                tile(t, outRow0[2 * t], outRow0[2 * t + 1], outRow1[2 * t], outRow1[2 * t + 1]);
+            }
+            if (wholeTiles < tilesX) {
+                double unused0, unused1;
+                tile(wholeTiles, outRow0[2 * wholeTiles], unused0, outRow1[2 * wholeTiles], unused1);
+            }
+        }
+    }, 4);
+}
+
+template <int Columns>
+void Convolution::correlateBlocked(const ImagePlane& in, ImagePlane& out, const std::vector<std::vector<double>>& kernel,
+                                   int anchorX, int anchorY, ImagePlane& padded) {
+    const int width = in.width;
+    const int height = in.height;
+    const int kw = kernelWidth(kernel);
+    const int kh = kernelHeight(kernel);
+
+    // Zero margins around the input, plus the slack of a last partial block, so that no tap needs a test
+    padded.resize(width + kw - 1 + Columns, height + kh - 1 + blockRows);
+    std::fill(padded.data.begin(), padded.data.end(), 0.0);
+    for (int y = 0; y < height; y++) {
+        std::copy_n(in.row(y), width, padded.row(y + anchorY) + anchorX);
+    }
+    // Weights by kernel row, so the taps of one input row are contiguous, with blockRows - 1 zero rows
+    // above and below: every input row then feeds all the rows of a block without bounds tests
+    const int paddedRows = kh + 2 * (blockRows - 1);
+    std::vector<double> weights(static_cast<std::size_t>(kw) * paddedRows, 0.0);
+    for (int i = 0; i < kw; i++) {
+        for (int j = 0; j < kh; j++) {
+            weights[(j + blockRows - 1) * kw + i] = kernel[i][j];
+        }
+    }
+
+    const int blocksY = (height + blockRows - 1) / blockRows;
+    ParallelUtils::forStrips(0, blocksY, [&](std::size_t blockBegin, std::size_t blockEnd) {
+        for (int blockY = blockBegin; blockY < static_cast<int>(blockEnd); blockY++) {
+            const int y0 = blockY * blockRows;
+            for (int x0 = 0; x0 < width; x0 += Columns) {
+                double sums[blockRows][Columns] = {};
+
+                // Input row y0 + v feeds output row y0 + r through kernel row v - r; each group of input
+                // values is loaded once and used for all the rows of the block
+                for (int v = 0; v < kh + blockRows - 1; v++) {
+                    const double* source = padded.row(y0 + v) + x0;
+                    const double* rowWeights = weights.data() + (v + blockRows - 1) * kw;
+                    for (int i = 0; i < kw; i++) {
+                        double values[Columns];
+                        for (int c = 0; c < Columns; c++) {
+                            values[c] = source[c + i];
+                        }
+                        for (int r = 0; r < blockRows; r++) {
+                            // Zero taps are skipped like in the dense loop, so inf and NaN inputs stay local
+                            double weight = rowWeights[i - r * kw];
+                            if (weight == 0.0) {
+                                continue;
+                            }
+                            for (int c = 0; c < Columns; c++) {
+                                sums[r][c] += values[c] * weight;
+                            }
+                        }
+                    }
+                }
+
+                const int columns = std::min(Columns, width - x0);
+                for (int r = 0; r < blockRows && y0 + r < height; r++) {
+                    std::copy_n(sums[r], columns, out.row(y0 + r) + x0);
+                }
+            }
+        }
+    });
+}
+
+void Convolution::correlateDirect(const ImagePlane& in, ImagePlane& out, const std::vector<std::vector<double>>& kernel,
+                                  int anchorX, int anchorY) {
+    const int width = in.width;
+    const int height = in.height;
+    const int kw = kernelWidth(kernel);
+    const int kh = kernelHeight(kernel);
+
+    // Taps are visited in the same order for every pixel, so each output sums in kernel order. For a tap,
+    // the x range whose source stays inside the row is computed once, which leaves a branch-free inner
+    // loop over contiguous pixels for the interior and nothing to do for the border.
+    ParallelUtils::forStrips(0, height, [&](std::size_t rowBegin, std::size_t rowEnd) {
+        for (int y = rowBegin; y < static_cast<int>(rowEnd); y++) {
+            double* outRow = out.row(y);
+            std::fill(outRow, outRow + width, 0.0);
+            for (int i = 0; i < kw; i++) {
+                int dx = i - anchorX;
+                int xBegin = std::max(0, -dx);
+                int xEnd = std::min(width, width - dx);
+                for (int j = 0; j < kh; j++) {
+                    double weight = kernel[i][j];
+                    int yj = y + j - anchorY;
+                    if (weight == 0.0 || yj < 0 || yj >= height) {
+                        continue;
+                    }
+                    const double* inRow = in.row(yj);
+                    for (int x = xBegin; x < xEnd; x++) {
+                        outRow[x] += inRow[x + dx] * weight;
+                    }
+                }
+            }
+        }
+    }, minStripRows);
+}
+
+void Convolution::correlateSeparable(const ImagePlane& in, ImagePlane& out, const std::vector<double>& weightsX,
+                                     const std::vector<double>& weightsY, int anchorX, int anchorY,
+                                     ImagePlane& vertical) {
+    const int width = in.width;
+    const int height = in.height;
+    vertical.resize(width, height);
+
+    // Vertical pass, vectorized along the rows
+    ParallelUtils::forStrips(0, height, [&](std::size_t rowBegin, std::size_t rowEnd) {
+        for (int y = rowBegin; y < static_cast<int>(rowEnd); y++) {
+            double* outRow = vertical.row(y);
+            std::fill(outRow, outRow + width, 0.0);
+            for (std::size_t j = 0; j < weightsY.size(); j++) {
+                int yj = y + static_cast<int>(j) - anchorY;
+                if (weightsY[j] == 0.0 || yj < 0 || yj >= height) {
+                    continue;
+                }
+                const double* inRow = in.row(yj);
+                for (int x = 0; x < width; x++) {
+                    outRow[x] += inRow[x] * weightsY[j];
+                }
+            }
+        }
+    }, minStripRows);
+
+    // Horizontal pass with the interior x range of each tap computed once
+    ParallelUtils::forStrips(0, height, [&](std::size_t rowBegin, std::size_t rowEnd) {
+        for (int y = rowBegin; y < static_cast<int>(rowEnd); y++) {
+            double* outRow = out.row(y);
+            std::fill(outRow, outRow + width, 0.0);
+            for (std::size_t i = 0; i < weightsX.size(); i++) {
+                int dx = static_cast<int>(i) - anchorX;
+                if (weightsX[i] == 0.0) {
+                    continue;
+                }
+                const double* inRow = vertical.row(y);
+                for (int x = std::max(0, -dx); x < std::min(width, width - dx); x++) {
+                    outRow[x] += inRow[x + dx] * weightsX[i];
+                }
+            }
+        }
+    }, minStripRows);
+}
+
+void Convolution::correlateFFT(const ImagePlane& in, ImagePlane& out, const std::vector<std::vector<double>>& kernel,
+                               int anchorX, int anchorY, const Layout& layout) {
+    const int width = in.width;
+    const int height = in.height;
+    const int kw = kernelWidth(kernel);
+    const int kh = kernelHeight(kernel);
+
+    // Pad so that the circular convolution does not wrap into the output, to the planned size if it is
+    // large enough
+    const FFTPadding padding = fftPadding(width, height, kw, kh);
+    const bool planned = layout.fftWidth >= padding.rawWidth && layout.fftHeight >= padding.rawHeight;
+    const int paddedWidth = planned ? layout.fftWidth : padding.paddedWidth;
+    const int paddedHeight = planned ? layout.fftHeight : padding.paddedHeight;
+    std::vector<std::complex<double>> image(static_cast<std::size_t>(paddedWidth) * paddedHeight);
+
+    for (int y = 0; y < height; y++) {
+        std::copy(in.row(y), in.row(y) + width, image.begin() + static_cast<std::size_t>(y) * paddedWidth);
+    }
+    // The kernel spectrum only depends on the kernel and the padded size, so repeated calls reuse it
+    const auto psf = PsfSpectrumCache::spectrum(kernel, anchorX, anchorY, paddedWidth, paddedHeight);
+
+    FFT::transform2D(image, paddedWidth, paddedHeight, false);
+    for (std::size_t k = 0; k < image.size(); k++) {
+        const std::complex<double> a = image[k];
+        const std::complex<double> b = (*psf)[k];
+        image[k] = {a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real()};
+    }
+    FFT::transform2D(image, paddedWidth, paddedHeight, true);
+
+    for (int y = 0; y < height; y++) {
+        double* outRow = out.row(y);
+        for (int x = 0; x < width; x++) {
+            outRow[x] = image[static_cast<std::size_t>(y) * paddedWidth + x].real();
+        }
+    }
+}
+
+void Convolution::pad(const ImagePlane& in, ImagePlane& out, int left, int top, int right, int bottom,
+                      Boundary boundary) {
+    const int width = in.width;
+    const int height = in.height;
+    out.resize(width + left + right, height + top + bottom);
+    if (boundary == Boundary::ZERO || in.size() == 0) {
+        std::fill(out.data.begin(), out.data.end(), 0.0);
+        for (int y = 0; y < height; y++) {
+            std::copy_n(in.row(y), width, out.row(y + top) + left);
+        }
+        return;
+    }
+
+    const Boundary source = boundary == Boundary::TAPER ? Boundary::MIRROR : boundary;
+    std::vector<int> columns(out.width);
+    std::vector<double> columnWeights(out.width, 1.0);
+    for (int x = 0; x < out.width; x++) {
+        columns[x] = boundaryIndex(x - left, width, source);
+        if (boundary == Boundary::TAPER) {
+            columnWeights[x] = x < left ? taperWeight(left - x, left) : taperWeight(x - left - width + 1, right);
+        }
+    }
+    ParallelUtils::forStrips(0, out.height, [&](std::size_t rowBegin, std::size_t rowEnd) {
+        for (int y = rowBegin; y < static_cast<int>(rowEnd); y++) {
+            const double* inRow = in.row(boundaryIndex(y - top, height, source));
+            double rowWeight = 1.0;
+            if (boundary == Boundary::TAPER) {
+                rowWeight = y < top ? taperWeight(top - y, top) : taperWeight(y - top - height + 1, bottom);
+            }
+            double* outRow = out.row(y);
+            for (int x = 0; x < out.width; x++) {
+                outRow[x] = rowWeight * columnWeights[x] * inRow[columns[x]];
+            }
+        }
+    }, minStripRows);
+}
+
+Convolution::FFTPadding Convolution::fftPadding(int width, int height, int kw, int kh) {
+    FFTPadding padding;
+    padding.rawWidth = width + kw - 1;
+    padding.rawHeight = height + kh - 1;
+    padding.paddedWidth = FFT::nextFastSize(padding.rawWidth);
+    padding.paddedHeight = FFT::nextFastSize(padding.rawHeight);
+    double rawCost = transformCost(padding.rawWidth, padding.rawHeight);
+    if (rawCost > 0.0) {
+        padding.relativeCost = transformCost(padding.paddedWidth, padding.paddedHeight) / rawCost;
+        padding.powerOfTwoCost = transformCost(FFT::nextPowerOfTwo(padding.rawWidth),
+                                               FFT::nextPowerOfTwo(padding.rawHeight)) / rawCost;
+    }
+    return padding;
+}
+
+void Convolution::boxFilter(const ImagePlane& in, ImagePlane& out, int size, int passes) {
+    if (size < 1 || passes < 1) {
+        throw std::invalid_argument("Box filter size and passes must be positive.");
+    }
+    if (passes == 1) {
+        boxFilterPass(IntegralImage(in), out, size);
+        return;
+    }
+
+    // Intermediate passes spill over the border, so run them on a zero margin wide enough for the
+    // result to equal one correlation with the composite kernel, then crop
+    const int margin = (passes - 1) * size;
+    ImagePlane padded(in.width + 2 * margin, in.height + 2 * margin, 0.0);
+    for (int y = 0; y < in.height; y++) {
+        std::copy_n(in.row(y), in.width, padded.row(y + margin) + margin);
+    }
+    IntegralImage table;
+    for (int pass = 0; pass < passes; pass++) {
+        table.build(padded);
+        boxFilterPass(table, padded, size);
+    }
+    out.resize(in.width, in.height);
+    for (int y = 0; y < in.height; y++) {
+        std::copy_n(padded.row(y + margin) + margin, in.width, out.row(y));
+    }
+}
+
+void Convolution::boxFilterPass(const IntegralImage& table, ImagePlane& out, int size) {
+    const int width = table.width();
+    const int height = table.height();
+    const int anchor = size / 2;
+    const double scale = 1.0 / (static_cast<double>(size) * size);
+    out.resize(width, height);
+
+    // Clipped box bounds of every column, shared by all rows
+    std::vector<int> left(width);
+    std::vector<int> right(width);
+    for (int x = 0; x < width; x++) {
+        left[x] = std::clamp(x - anchor, 0, width);
+        right[x] = std::clamp(x - anchor + size, 0, width);
+    }
+
+    ParallelUtils::forStrips(0, height, [&](std::size_t rowBegin, std::size_t rowEnd) {
+        for (std::size_t y = rowBegin; y < rowEnd; y++) {
+            const double* top = table.row(std::clamp<int>(y - anchor, 0, height));
+            const double* bottom = table.row(std::clamp<int>(y - anchor + size, 0, height));
+            double* output = out.row(y);
+            for (int x = 0; x < width; x++) {
+                output[x] = (bottom[right[x]] - bottom[left[x]] - top[right[x]] + top[left[x]]) * scale;
+            }
+        }
+    }, minStripRows);
+}
+
+void Convolution::gaussianRecursive(const ImagePlane& in, ImagePlane& out, double sigma) {
+    // Filter the columns, then the rows as the columns of the transposed image
+    ImagePlane columns = in;
+    recursiveGaussianColumns(columns, sigma);
+    ImagePlane transposed;
+    transpose(columns, transposed);
+    recursiveGaussianColumns(transposed, sigma);
+    transpose(transposed, out);
+}
+
+void Convolution::recursiveGaussianColumns(ImagePlane& plane, double sigma) {
+    const int width = plane.width;
+    const int height = plane.height;
+    sigma = std::max(sigma, 0.5);
+
+    // Young and van Vliet recursion with the pole placement of van Vliet, Young and Verbeek, "Recursive
+    // Gaussian derivative filters" (ICPR 1998): the poles for sigma 2 are scaled by the power 1 / q, with
+    // q chosen so that the variance of the forward-backward filter is exactly sigma squared
+    const std::complex<double> d1(1.40098, 1.00236);
+    const double d3 = 1.85132;
+    auto variance = [&](double q) {
+        std::complex<double> p1 = std::pow(d1, 1.0 / q);
+        double p3 = std::pow(d3, 1.0 / q);
+        return 2.0 * (2.0 * std::real(p1 / ((p1 - 1.0) * (p1 - 1.0)))) + 2.0 * p3 / ((p3 - 1.0) * (p3 - 1.0));
+    };
+    double q = sigma / 2.0;
+    for (int step = 0; step < 20; step++) {
+        // Newton steps on the variance, with a central difference for the derivative
+        double h = 1e-6 * q;
+        double slope = (variance(q + h) - variance(q - h)) / (2.0 * h);
+        q -= (variance(q) - sigma * sigma) / slope;
+    }
+    std::complex<double> a1 = 1.0 / std::pow(d1, 1.0 / q);
+    double a3 = 1.0 / std::pow(d3, 1.0 / q);
+    double b1 = 2.0 * a1.real() + a3;
+    double b2 = -(std::norm(a1) + 2.0 * a1.real() * a3);
+    double b3 = std::norm(a1) * a3;
+    double gain = 1.0 - (b1 + b2 + b3);
+
+    const int tail = static_cast<int>(std::ceil(3.0 * sigma)) + 3;
+    const int extended = height + tail;
+
+    // Every row update is an element-wise operation over a strip of columns, so the recursion runs
+    // along y while the columns are processed as SIMD lanes
+    ParallelUtils::forStrips(0, width, [&](std::size_t columnBegin, std::size_t columnEnd) {
+        const int count = columnEnd - columnBegin;
+        std::vector<double> causal(static_cast<std::size_t>(extended) * count, 0.0);
+        auto causalRow = [&](int y) { return causal.data() + static_cast<std::size_t>(y) * count; };
+
+        for (int y = 0; y < extended; y++) {
+            double* w = causalRow(y);
+            const double* input = y < height ? plane.row(y) + columnBegin : nullptr;
+            const double* w1 = y >= 1 ? causalRow(y - 1) : nullptr;
+            const double* w2 = y >= 2 ? causalRow(y - 2) : nullptr;
+            const double* w3 = y >= 3 ? causalRow(y - 3) : nullptr;
+            for (int x = 0; x < count; x++) {
+                double value = input ? gain * input[x] : 0.0;
+                if (w1) value += b1 * w1[x];
+                if (w2) value += b2 * w2[x];
+                if (w3) value += b3 * w3[x];
+                w[x] = value;
+            }
+        }
+
+        std::vector<double> next(3 * count, 0.0);
+        double* o1 = next.data();
+        double* o2 = next.data() + count;
+        double* o3 = next.data() + 2 * count;
+        for (int y = extended - 1; y >= 0; y--) {
+            const double* w = causalRow(y);
+            double* output = y < height ? plane.row(y) + columnBegin : nullptr;
+            for (int x = 0; x < count; x++) {
+                double value = gain * w[x] + b1 * o1[x] + b2 * o2[x] + b3 * o3[x];
+                o3[x] = o2[x];
+                o2[x] = o1[x];
+                o1[x] = value;
+                if (output) output[x] = value;
+            }
+        }
+    }, 16);
+}
+
+void Convolution::transpose(const ImagePlane& in, ImagePlane& out) {
+    out.resize(in.height, in.width);
+    constexpr int block = 32;
+    ParallelUtils::forStrips(0, (in.height + block - 1) / block, [&](std::size_t blockBegin, std::size_t blockEnd) {
+        for (int y0 = blockBegin * block; y0 < std::min<int>(in.height, blockEnd * block); y0 += block) {
+            for (int x0 = 0; x0 < in.width; x0 += block) {
+                for (int y = y0; y < std::min(in.height, y0 + block); y++) {
+                    for (int x = x0; x < std::min(in.width, x0 + block); x++) {
+                        out(y, x) = in(x, y);
+                    }
+                }
+            }
+        }
+    });
+}
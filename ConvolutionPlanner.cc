@@ -0,0 +1,245 @@
+#include "ConvolutionPlanner.hh"
+#include "CounterRng.hh"
+#include "FFT.hh"
+#include "ParallelUtils.hh"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <sstream>
+
+namespace {
+    using Algorithm = Convolution::Algorithm;
+
+    // WINOGRAD is left out: it never beats the unrolled 3x3 loop (see Convolution::Algorithm)
+    const std::vector<Algorithm> allAlgorithms = {Algorithm::DIRECT, Algorithm::SEPARABLE, Algorithm::SPARSE,
+                                                  Algorithm::BLOCKED, Algorithm::FFT};
+    const char* const algorithmNames[] = {"auto", "direct", "separable", "sparse", "winograd", "blocked", "fft"};
+
+    std::mutex plannerMutex;
+    std::map<std::string, ConvolutionPlanner::Plan> plans;
+    std::string wisdomFile;
+    bool wisdomLoaded = false;
+    bool tuning = false;
+
+    // Machine the measurements hold for: processor model and thread count
+    std::string cpuSignature() {
+        std::string model = "unknown";
+        std::ifstream cpuinfo("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(cpuinfo, line)) {
+            if (line.rfind("model name", 0) == 0) {
+                model = line.substr(line.find(':') + 2);
+                break;
+            }
+        }
+        std::replace(model.begin(), model.end(), ' ', '_');
+        return model + "/" + std::to_string(ParallelUtils::threadCount());
+    }
+
+    // First line of a wisdom file: format version and machine
+    std::string wisdomHeader() {
+        return "wisdom 3 cpu " + cpuSignature();
+    }
+
+    int algorithmIndex(const std::string& name) {
+        for (int index = 0; index < 7; index++) {
+            if (name == algorithmNames[index]) {
+                return index;
+            }
+        }
+        return -1;
+    }
+
+    void loadWisdom() {
+        wisdomLoaded = true;
+        if (wisdomFile.empty()) {
+            return;
+        }
+        std::ifstream file(wisdomFile);
+        std::string line;
+        if (!std::getline(file, line) || line != wisdomHeader()) {
+            // Plans measured elsewhere, or in an older format, do not apply here
+            return;
+        }
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::string key, name;
+            ConvolutionPlanner::Plan plan;
+            if (fields >> key >> name >> plan.milliseconds >> plan.layout.fftWidth >> plan.layout.fftHeight >>
+                    plan.layout.blockColumns && algorithmIndex(name) > 0) {
+                plan.algorithm = static_cast<Algorithm>(algorithmIndex(name));
+                plans[key] = plan;
+            }
+        }
+    }
+
+    void saveWisdom() {
+        if (wisdomFile.empty()) {
+            return;
+        }
+        std::ofstream file(wisdomFile, std::ios::trunc);
+        if (!file) {
+            return;
+        }
+        file << wisdomHeader() << "\n";
+        for (const auto& [key, plan] : plans) {
+            file << key << " " << algorithmNames[static_cast<int>(plan.algorithm)] << " " << plan.milliseconds << " "
+                 << plan.layout.fftWidth << " " << plan.layout.fftHeight << " " << plan.layout.blockColumns << "\n";
+        }
+    }
+
+    double millisecondsSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Sizes an algorithm can run at: the default ones first, then the alternatives tuning measures
+    std::vector<Convolution::Layout> layouts(Algorithm algorithm, int width, int height, int kw, int kh, bool tuned) {
+        std::vector<Convolution::Layout> choices;
+        if (algorithm == Algorithm::FFT) {
+            Convolution::FFTPadding padding = Convolution::fftPadding(width, height, kw, kh);
+            choices.push_back({padding.paddedWidth, padding.paddedHeight, 0});
+            const int powerWidth = FFT::nextPowerOfTwo(padding.rawWidth);
+            const int powerHeight = FFT::nextPowerOfTwo(padding.rawHeight);
+            if (tuned && (powerWidth != padding.paddedWidth || powerHeight != padding.paddedHeight)) {
+                choices.push_back({powerWidth, powerHeight, 0});
+            }
+        } else if (algorithm == Algorithm::BLOCKED) {
+            choices.push_back({0, 0, Convolution::blockColumns});
+            for (int columns : Convolution::blockColumnChoices) {
+                if (tuned && columns != Convolution::blockColumns) {
+                    choices.push_back({0, 0, columns});
+                }
+            }
+        } else {
+            choices.push_back({});
+        }
+        return choices;
+    }
+}
+
+ConvolutionPlanner::Plan ConvolutionPlanner::plan(int width, int height, const std::vector<std::vector<double>>& kernel,
+                                                  int anchorX, int anchorY, const std::vector<Algorithm>& candidates) {
+    const int kw = kernel.size();
+    const int kh = kernel.empty() ? 0 : kernel[0].size();
+    const std::vector<Algorithm>& allowed = candidates.empty() ? allAlgorithms : candidates;
+
+    // Candidates that apply to this kernel, with their cost model estimate
+    std::vector<std::pair<Algorithm, double>> estimates;
+    double cheapest = std::numeric_limits<double>::infinity();
+    for (Algorithm algorithm : allowed) {
+        if (algorithm == Algorithm::WINOGRAD && (anchorX != 1 || anchorY != 1)) {
+            continue;
+        }
+        double cost = Convolution::estimatedCost(algorithm, width, height, kernel);
+        if (cost < std::numeric_limits<double>::infinity()) {
+            estimates.push_back({algorithm, cost});
+            cheapest = std::min(cheapest, cost);
+        }
+    }
+
+    Plan plan;
+    if (estimates.empty()) {
+        return plan;
+    }
+
+    // Shape class: sizes, anchor, the kernel properties the algorithms depend on, and the candidate set
+    int candidateMask = 0;
+    for (Algorithm algorithm : allowed) {
+        candidateMask |= 1 << static_cast<int>(algorithm);
+    }
+    std::ostringstream key;
+    key << width << "x" << height << ":" << kw << "x" << kh << "@" << anchorX << "," << anchorY << ":"
+        << Convolution::estimatedCost(Algorithm::SPARSE, width, height, kernel) << "taps:"
+        << (Convolution::estimatedCost(Algorithm::SEPARABLE, width, height, kernel) < std::numeric_limits<double>::infinity())
+        << "sep:" << candidateMask;
+
+    {
+        std::lock_guard<std::mutex> lock(plannerMutex);
+        if (!wisdomLoaded) {
+            loadWisdom();
+        }
+        auto known = plans.find(key.str());
+        if (known != plans.end()) {
+            return known->second;
+        }
+        if (!tuning) {
+            plan.algorithm = std::min_element(estimates.begin(), estimates.end(), [](const auto& a, const auto& b) {
+                return a.second < b.second;
+            })->first;
+            plan.layout = layouts(plan.algorithm, width, height, kw, kh, false).front();
+            return plan;
+        }
+    }
+
+    // Time the plausible candidates at each of their sizes on the same synthetic image, best of two runs
+    // each, without holding the planner
+    ImagePlane input(width, height);
+    CounterRng(0).uniforms(0, input.size(), 0, input.data.data());
+    ImagePlane output;
+    Convolution::Workspace workspace;
+    double fastest = std::numeric_limits<double>::infinity();
+    for (const auto& [algorithm, cost] : estimates) {
+        if (cost > 3.0 * cheapest) {
+            continue;
+        }
+        for (const Convolution::Layout& layout : layouts(algorithm, width, height, kw, kh, true)) {
+            double elapsed = std::numeric_limits<double>::infinity();
+            for (int run = 0; run < 2; run++) {
+                auto start = std::chrono::steady_clock::now();
+                Convolution::correlate(input, output, kernel, anchorX, anchorY, workspace, algorithm,
+                                       Convolution::Boundary::ZERO, layout);
+                elapsed = std::min(elapsed, millisecondsSince(start));
+            }
+            if (elapsed < fastest) {
+                fastest = elapsed;
+                plan.algorithm = algorithm;
+                plan.layout = layout;
+                plan.milliseconds = elapsed;
+            }
+        }
+    }
+
+    // A plan another thread published for the shape meanwhile stands, so every caller gets the same one
+    std::lock_guard<std::mutex> lock(plannerMutex);
+    auto [published, inserted] = plans.insert({key.str(), plan});
+    if (inserted) {
+        saveWisdom();
+    }
+    return published->second;
+}
+
+void ConvolutionPlanner::setWisdomFile(const std::string& path) {
+    std::lock_guard<std::mutex> lock(plannerMutex);
+    wisdomFile = path;
+    plans.clear();
+    wisdomLoaded = false;
+}
+
+void ConvolutionPlanner::setTuning(bool enabled) {
+    std::lock_guard<std::mutex> lock(plannerMutex);
+    tuning = enabled;
+}
+
+void ConvolutionPlanner::forget() {
+    std::lock_guard<std::mutex> lock(plannerMutex);
+    plans.clear();
+    wisdomLoaded = true;
+    if (!wisdomFile.empty()) {
+        std::remove(wisdomFile.c_str());
+    }
+}
+
+void ConvolutionPlanner::configureFromEnvironment() {
+    const char* enabled = std::getenv("LUCY_TUNING");
+    if (!enabled || std::string(enabled) != "1") {
+        return;
+    }
+    const char* path = std::getenv("LUCY_WISDOM");
+    setWisdomFile(path && *path ? path : "results/convolution.wisdom");
+    setTuning(true);
+}
@@ -2,8 +2,10 @@
 // Created by scott on 05/07/23.
 //
 #include "bitmap_image.hpp"
+#include <algorithm>
 #include <cmath>
 #include "DeconvolutionUtils.hh"
+#include "ParallelUtils.hh"
 
 void DeconvolutionUtils::computeDifference(const bitmap_image& blurredImage, const bitmap_image& unblurredImage, bitmap_image& differenceImage) {
     if (blurredImage.width() != unblurredImage.width() || blurredImage.height() != unblurredImage.height()) {
@@ -40,36 +42,153 @@ void DeconvolutionUtils::applyGrayscalePrior(bitmap_image& differenceImage) {
     }
 }
 
-std::vector<std::vector<double>> DeconvolutionUtils::computeGradientX(const std::vector<std::vector<double>> &image) {
-    std::vector<std::vector<double>> gradientX(image.size(), std::vector<double>(image[0].size(), 0.0));
+ImagePlane DeconvolutionUtils::computeGradientX(const ImagePlane &image) {
+    ImagePlane gradientX(image.width, image.height);
 
-    for (std::size_t x = 0; x < image.size(); x++) {
-        for (std::size_t y = 0; y < image[x].size(); y++) {
+    for (int y = 0; y < image.height; y++) {
+        for (int x = 0; x < image.width; x++) {
             if (x == 0)
-                gradientX[x][y] = image[x + 1][y] - image[x][y];
-            else if (x == image.size() - 1)
-                gradientX[x][y] = image[x][y] - image[x - 1][y];
+                gradientX(x, y) = image(x + 1, y) - image(x, y);
+            else if (x == image.width - 1)
+                gradientX(x, y) = image(x, y) - image(x - 1, y);
             else
-                gradientX[x][y] = (image[x + 1][y] - image[x - 1][y]) / 2.0;
+                gradientX(x, y) = (image(x + 1, y) - image(x - 1, y)) / 2.0;
         }
     }
 
     return gradientX;
 }
 
-std::vector<std::vector<double>> DeconvolutionUtils::computeGradientY(const std::vector<std::vector<double>> &image) {
-    std::vector<std::vector<double>> gradientY(image.size(), std::vector<double>(image[0].size(), 0.0));
+ImagePlane DeconvolutionUtils::computeGradientY(const ImagePlane &image) {
+    ImagePlane gradientY(image.width, image.height);
 
-    for (std::size_t x = 0; x < image.size(); x++) {
-        for (std::size_t y = 0; y < image[x].size(); y++) {
+    for (int y = 0; y < image.height; y++) {
+        for (int x = 0; x < image.width; x++) {
             if (y == 0)
-                gradientY[x][y] = image[x][y + 1] - image[x][y];
-            else if (y == image[x].size() - 1)
-                gradientY[x][y] = image[x][y] - image[x][y - 1];
+                gradientY(x, y) = image(x, y + 1) - image(x, y);
+            else if (y == image.height - 1)
+                gradientY(x, y) = image(x, y) - image(x, y - 1);
             else
-                gradientY[x][y] = (image[x][y + 1] - image[x][y - 1]) / 2.0;
+                gradientY(x, y) = (image(x, y + 1) - image(x, y - 1)) / 2.0;
         }
     }
 
     return gradientY;
-}
\ No newline at end of file
+}
+
+void DeconvolutionUtils::applyTVUpdate(const ImagePlane& estimate, ImagePlane& correction, double lambda, double alpha) {
+    const int width = estimate.width;
+    const int height = estimate.height;
+
+    ParallelUtils::forStrips(0, height, [&](std::size_t rowBegin, std::size_t rowEnd) {
+        for (int y = rowBegin; y < static_cast<int>(rowEnd); y++) {
+            // Rows above and below for the y gradient: one-sided at the first and last rows
+            const double* current = estimate.row(y);
+            const double* above = estimate.row(y == 0 ? y : y - 1);
+            const double* below = estimate.row(y == height - 1 ? y : y + 1);
+            const bool centralY = y > 0 && y < height - 1;
+            double* output = correction.row(y);
+
+            auto update = [&](int x, double gx) {
+                double gy = centralY ? (below[x] - above[x]) / 2.0 : below[x] - above[x];
+                double tvWeight = alpha / (std::sqrt(gx * gx + gy * gy) + lambda);
+                double difference = current[x] - output[x];
+                output[x] = current[x] * (output[x] + tvWeight * difference);
+            };
+
+            if (width == 1) {
+                update(0, 0.0);
+                continue;
+            }
+            update(0, current[1] - current[0]);
+            for (int x = 1; x < width - 1; x++) {
+                update(x, (current[x + 1] - current[x - 1]) / 2.0);
+            }
+            update(width - 1, current[width - 1] - current[width - 2]);
+        }
+    }, 8);
+}
+
+void DeconvolutionUtils::applyDualTVStep(const ImagePlane& primal, ImagePlane& dualX, ImagePlane& dualY, double sigma,
+                                         double lambda) {
+    const int width = primal.width;
+    const int height = primal.height;
+
+    ParallelUtils::forStrips(0, height, [&](std::size_t rowBegin, std::size_t rowEnd) {
+        for (int y = rowBegin; y < static_cast<int>(rowEnd); y++) {
+            const double* current = primal.row(y);
+            const double* below = primal.row(y == height - 1 ? 0 : y + 1);
+            double* px = dualX.row(y);
+            double* py = dualY.row(y);
+            for (int x = 0; x < width; x++) {
+                double right = x == width - 1 ? current[0] : current[x + 1];
+                double nextX = px[x] + sigma * (right - current[x]);
+                double nextY = py[x] + sigma * (below[x] - current[x]);
+                double shrink = std::max(1.0, std::sqrt(nextX * nextX + nextY * nextY) / lambda);
+                px[x] = nextX / shrink;
+                py[x] = nextY / shrink;
+            }
+        }
+    }, 8);
+}
+
+void DeconvolutionUtils::applyDivergenceStep(const ImagePlane& estimate, const ImagePlane& dualX,
+                                             const ImagePlane& dualY, double tau,
+                                             std::vector<std::complex<double>>& out) {
+    const int width = estimate.width;
+    const int height = estimate.height;
+    out.resize(estimate.size());
+
+    ParallelUtils::forStrips(0, height, [&](std::size_t rowBegin, std::size_t rowEnd) {
+        for (int y = rowBegin; y < static_cast<int>(rowEnd); y++) {
+            const double* current = estimate.row(y);
+            const double* px = dualX.row(y);
+            const double* py = dualY.row(y);
+            const double* pyAbove = dualY.row(y == 0 ? height - 1 : y - 1);
+            std::complex<double>* output = out.data() + static_cast<std::size_t>(y) * width;
+            for (int x = 0; x < width; x++) {
+                double pxLeft = x == 0 ? px[width - 1] : px[x - 1];
+                double divergence = px[x] - pxLeft + py[x] - pyAbove[x];
+                output[x] = current[x] + tau * divergence;
+            }
+        }
+    }, 8);
+}
+
+void DeconvolutionUtils::applyADMMSplitStep(const ImagePlane& estimate, ImagePlane& dualX, ImagePlane& dualY,
+                                            ImagePlane& dualPositive, ImagePlane& targetX, ImagePlane& targetY,
+                                            ImagePlane& targetPositive, double threshold) {
+    const int width = estimate.width;
+    const int height = estimate.height;
+
+    ParallelUtils::forStrips(0, height, [&](std::size_t rowBegin, std::size_t rowEnd) {
+        for (int y = rowBegin; y < static_cast<int>(rowEnd); y++) {
+            const double* current = estimate.row(y);
+            const double* below = estimate.row(y == height - 1 ? 0 : y + 1);
+            double* ux = dualX.row(y);
+            double* uy = dualY.row(y);
+            double* uPositive = dualPositive.row(y);
+            double* tx = targetX.row(y);
+            double* ty = targetY.row(y);
+            double* tPositive = targetPositive.row(y);
+            for (int x = 0; x < width; x++) {
+                double right = x == width - 1 ? current[0] : current[x + 1];
+                double wx = right - current[x] + ux[x];
+                double wy = below[x] - current[x] + uy[x];
+                double magnitude = std::sqrt(wx * wx + wy * wy);
+                double scale = magnitude > threshold ? 1.0 - threshold / magnitude : 0.0;
+                double zx = scale * wx;
+                double zy = scale * wy;
+                ux[x] = wx - zx;
+                uy[x] = wy - zy;
+                tx[x] = zx - ux[x];
+                ty[x] = zy - uy[x];
+
+                double v = current[x] + uPositive[x];
+                double w = std::max(v, 0.0);
+                uPositive[x] = v - w;
+                tPositive[x] = w - uPositive[x];
+            }
+        }
+    }, 8);
+}
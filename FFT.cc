@@ -0,0 +1,263 @@
+#include "FFT.hh"
+#include "ParallelUtils.hh"
+#include <cmath>
+#include <algorithm>
+
+namespace {
+    // Plain complex product; operator* on std::complex goes through the slow IEEE inf/NaN recovery path
+    inline std::complex<double> multiply(const std::complex<double>& a, const std::complex<double>& b) {
+        return {a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real()};
+    }
+
+    // z times -i for the forward transform, +i for the inverse
+    inline std::complex<double> rotateQuarter(const std::complex<double>& z, bool inverse) {
+        return inverse ? std::complex<double>(-z.imag(), z.real()) : std::complex<double>(z.imag(), -z.real());
+    }
+}
+
+FFT::FFT(std::size_t size) : n(size), forwardTwiddles(size), inverseTwiddles(size) {
+    for (std::size_t i = 0; i < n; i++) {
+        double phase = -2.0 * M_PI * static_cast<double>(i) / static_cast<double>(n);
+        forwardTwiddles[i] = std::polar(1.0, phase);
+        inverseTwiddles[i] = std::conj(forwardTwiddles[i]);
+    }
+
+    // Factor as 4s first, then 2s, then odd factors in increasing order
+    std::size_t remaining = n;
+    std::size_t radix = 4;
+    std::size_t limit = static_cast<std::size_t>(std::sqrt(static_cast<double>(n)));
+    while (remaining > 1) {
+        while (remaining % radix != 0) {
+            radix = radix == 4 ? 2 : radix == 2 ? 3 : radix + 2;
+            if (radix > limit) {
+                radix = remaining;
+            }
+        }
+        remaining /= radix;
+        factors.push_back(radix);
+        factors.push_back(remaining);
+    }
+}
+
+void FFT::forward(std::complex<double>* data) const {
+    transform(data, false);
+}
+
+void FFT::inverse(std::complex<double>* data) const {
+    transform(data, true);
+}
+
+void FFT::transform(std::complex<double>* data, bool inverse) const {
+    if (n <= 1) {
+        return;
+    }
+    thread_local std::vector<std::complex<double>> input;
+    input.assign(data, data + n);
+    work(data, input.data(), 1, factors.data(), inverse ? inverseTwiddles : forwardTwiddles, inverse);
+}
+
+void FFT::work(std::complex<double>* out, const std::complex<double>* in, std::size_t stride,
+               const std::size_t* factor, const std::vector<std::complex<double>>& twiddles, bool inverse) const {
+    std::size_t radix = factor[0];
+    std::size_t m = factor[1];
+    std::complex<double>* outEnd = out + radix * m;
+
+    if (m == 1) {
+        for (std::complex<double>* o = out; o != outEnd; o++, in += stride) {
+            *o = *in;
+        }
+    } else {
+        // Transform the radix decimated subsequences, each into its own block of m outputs
+        for (std::complex<double>* o = out; o != outEnd; o += m, in += stride) {
+            work(o, in, stride * radix, factor + 2, twiddles, inverse);
+        }
+    }
+    butterfly(out, stride, radix, m, twiddles, inverse);
+}
+
+void FFT::butterfly(std::complex<double>* out, std::size_t stride, std::size_t radix, std::size_t m,
+                    const std::vector<std::complex<double>>& twiddles, bool inverse) const {
+    if (radix == 2) {
+        for (std::size_t k = 0; k < m; k++) {
+            std::complex<double> t = multiply(out[k + m], twiddles[k * stride]);
+            out[k + m] = out[k] - t;
+            out[k] += t;
+        }
+    } else if (radix == 4) {
+        for (std::size_t k = 0; k < m; k++) {
+            std::complex<double> s0 = multiply(out[k + m], twiddles[k * stride]);
+            std::complex<double> s1 = multiply(out[k + 2 * m], twiddles[2 * k * stride]);
+            std::complex<double> s2 = multiply(out[k + 3 * m], twiddles[3 * k * stride]);
+            std::complex<double> s5 = out[k] - s1;
+            std::complex<double> s3 = s0 + s2;
+            std::complex<double> s4 = s0 - s2;
+            out[k] += s1;
+            out[k + 2 * m] = out[k] - s3;
+            out[k] += s3;
+            // s4 rotated by -i for the forward transform, +i for the inverse
+            std::complex<double> rotated = inverse ? std::complex<double>(-s4.imag(), s4.real())
+                                                   : std::complex<double>(s4.imag(), -s4.real());
+            out[k + m] = s5 + rotated;
+            out[k + 3 * m] = s5 - rotated;
+        }
+    } else if (radix == 3) {
+        const double sin60 = std::sqrt(3.0) / 2.0;
+        for (std::size_t k = 0; k < m; k++) {
+            std::complex<double> t1 = multiply(out[k + m], twiddles[k * stride]);
+            std::complex<double> t2 = multiply(out[k + 2 * m], twiddles[2 * k * stride]);
+            std::complex<double> sum = t1 + t2;
+            std::complex<double> rotated = rotateQuarter(sin60 * (t1 - t2), inverse);
+            std::complex<double> middle = out[k] - 0.5 * sum;
+            out[k] += sum;
+            out[k + m] = middle + rotated;
+            out[k + 2 * m] = middle - rotated;
+        }
+    } else if (radix == 5) {
+        const double cos72 = std::cos(2.0 * M_PI / 5.0);
+        const double cos144 = std::cos(4.0 * M_PI / 5.0);
+        const double sin72 = std::sin(2.0 * M_PI / 5.0);
+        const double sin144 = std::sin(4.0 * M_PI / 5.0);
+        for (std::size_t k = 0; k < m; k++) {
+            std::complex<double> t1 = multiply(out[k + m], twiddles[k * stride]);
+            std::complex<double> t2 = multiply(out[k + 2 * m], twiddles[2 * k * stride]);
+            std::complex<double> t3 = multiply(out[k + 3 * m], twiddles[3 * k * stride]);
+            std::complex<double> t4 = multiply(out[k + 4 * m], twiddles[4 * k * stride]);
+            // Outputs q and 5 - q share their real parts and have opposite rotated parts
+            std::complex<double> a1 = t1 + t4, b1 = t1 - t4, a2 = t2 + t3, b2 = t2 - t3;
+            std::complex<double> x0 = out[k];
+            std::complex<double> real1 = x0 + cos72 * a1 + cos144 * a2;
+            std::complex<double> real2 = x0 + cos144 * a1 + cos72 * a2;
+            std::complex<double> rotated1 = rotateQuarter(sin72 * b1 + sin144 * b2, inverse);
+            std::complex<double> rotated2 = rotateQuarter(sin144 * b1 - sin72 * b2, inverse);
+            out[k] = x0 + a1 + a2;
+            out[k + m] = real1 + rotated1;
+            out[k + 4 * m] = real1 - rotated1;
+            out[k + 2 * m] = real2 + rotated2;
+            out[k + 3 * m] = real2 - rotated2;
+        }
+    } else {
+        thread_local std::vector<std::complex<double>> scratch;
+        scratch.resize(radix);
+        for (std::size_t u = 0; u < m; u++) {
+            for (std::size_t q = 0, k = u; q < radix; q++, k += m) {
+                scratch[q] = out[k];
+            }
+            for (std::size_t q = 0, k = u; q < radix; q++, k += m) {
+                std::size_t twiddleIndex = 0;
+                std::complex<double> sum = scratch[0];
+                for (std::size_t p = 1; p < radix; p++) {
+                    twiddleIndex += stride * k;
+                    if (twiddleIndex >= n) {
+                        twiddleIndex %= n;
+                    }
+                    sum += multiply(scratch[p], twiddles[twiddleIndex]);
+                }
+                out[k] = sum;
+            }
+        }
+    }
+}
+
+void FFT::transform2D(std::vector<std::complex<double>>& data, int width, int height, bool inverse) {
+    const FFT rowFFT(width);
+    const FFT columnFFT(height);
+
+    ParallelUtils::forStrips(0, height, [&](std::size_t rowBegin, std::size_t rowEnd) {
+        for (std::size_t y = rowBegin; y < rowEnd; y++) {
+            rowFFT.transform(&data[y * width], inverse);
+        }
+    });
+
+    // Columns are gathered a few at a time so every pass over the rows touches whole cache lines
+    ParallelUtils::forStrips(0, width, [&](std::size_t columnBegin, std::size_t columnEnd) {
+        constexpr std::size_t group = 8;
+        std::vector<std::complex<double>> columns(group * height);
+        for (std::size_t x0 = columnBegin; x0 < columnEnd; x0 += group) {
+            std::size_t count = std::min(group, columnEnd - x0);
+            for (int y = 0; y < height; y++) {
+                for (std::size_t c = 0; c < count; c++) {
+                    columns[c * height + y] = data[y * width + x0 + c];
+                }
+            }
+            for (std::size_t c = 0; c < count; c++) {
+                columnFFT.transform(&columns[c * height], inverse);
+            }
+            for (int y = 0; y < height; y++) {
+                for (std::size_t c = 0; c < count; c++) {
+                    data[y * width + x0 + c] = columns[c * height + y];
+                }
+            }
+        }
+    });
+
+    if (inverse) {
+        double scale = 1.0 / (static_cast<double>(width) * height);
+        for (auto& value : data) {
+            value *= scale;
+        }
+    }
+}
+
+std::size_t FFT::nextPowerOfTwo(std::size_t n) {
+    std::size_t size = 1;
+    while (size < n) {
+        size *= 2;
+    }
+    return size;
+}
+
+bool FFT::isSmooth(std::size_t n) {
+    if (n == 0) {
+        return false;
+    }
+    for (std::size_t prime : {2, 3, 5, 7}) {
+        while (n % prime == 0) {
+            n /= prime;
+        }
+    }
+    return n == 1;
+}
+
+double FFT::estimatedCost(std::size_t n) {
+    // Same factorization as the constructor: 4s first, then 2s, then odd factors
+    double perPoint = 0.0;
+    std::size_t remaining = n;
+    for (std::size_t radix = 4; remaining > 1;) {
+        if (remaining % radix != 0) {
+            radix = radix == 4 ? 2 : radix == 2 ? 3 : radix + 2;
+            if (radix * radix > remaining) {
+                radix = remaining;
+            }
+            continue;
+        }
+        remaining /= radix;
+        switch (radix) {
+            case 2:
+            case 3:
+                perPoint += 3.0;
+                break;
+            case 4:
+                perPoint += 2.0;
+                break;
+            case 5:
+                perPoint += 4.0;
+                break;
+            default:
+                perPoint += 2.5 * radix;
+                break;
+        }
+    }
+    return perPoint * n;
+}
+
+std::size_t FFT::nextFastSize(std::size_t n) {
+    std::size_t best = nextPowerOfTwo(n);
+    double bestCost = estimatedCost(best);
+    for (std::size_t size = n; size < best; size++) {
+        if (isSmooth(size) && estimatedCost(size) < bestCost) {
+            best = size;
+            bestCost = estimatedCost(size);
+        }
+    }
+    return best;
+}
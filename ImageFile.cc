@@ -0,0 +1,279 @@
+#include "ImageFile.hh"
+#include "PlaneFile.hh"
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <limits>
+
+namespace {
+    // Compression values of the BMP information header
+    enum Compression : std::uint32_t { BI_RGB = 0, BI_BITFIELDS = 3, BI_ALPHABITFIELDS = 6 };
+
+    bool hasExtension(const std::string& path, const std::string& extension) {
+        if (path.size() < extension.size()) {
+            return false;
+        }
+        return std::equal(extension.begin(), extension.end(), path.end() - extension.size(),
+                          [](char a, char b) { return a == std::tolower(static_cast<unsigned char>(b)); });
+    }
+
+    std::uint32_t littleEndian(const std::vector<unsigned char>& bytes, std::size_t offset, int size) {
+        std::uint32_t value = 0;
+        for (int i = size - 1; i >= 0; i--) {
+            value = (value << 8) | bytes[offset + i];
+        }
+        return value;
+    }
+
+    // A color image whose channels are all equal is kept as one plane
+    void collapseGray(std::vector<ImagePlane>& channels) {
+        if (channels.size() == 3 && channels[0].data == channels[1].data && channels[0].data == channels[2].data) {
+            channels.resize(1);
+        }
+    }
+
+    // Channel of a bitfields pixel, scaled from its mask width to 0..255
+    struct BitField {
+        std::uint32_t mask = 0;
+        int shift = 0;
+        double scale = 0.0;
+
+        explicit BitField(std::uint32_t mask) : mask(mask) {
+            if (mask != 0) {
+                shift = std::countr_zero(mask);
+                scale = 255.0 / (mask >> shift);
+            }
+        }
+
+        double operator()(std::uint32_t pixel) const { return ((pixel & mask) >> shift) * scale; }
+    };
+
+    bool loadBitmap(const std::vector<unsigned char>& file, std::vector<ImagePlane>& channels) {
+        // File header (14 bytes), then an information header of at least the 40 bytes of BITMAPINFOHEADER
+        if (file.size() < 54) {
+            return false;
+        }
+        const std::size_t pixelOffset = littleEndian(file, 10, 4);
+        const std::size_t infoSize = littleEndian(file, 14, 4);
+        const auto width = static_cast<std::int32_t>(littleEndian(file, 18, 4));
+        const auto signedHeight = static_cast<std::int32_t>(littleEndian(file, 22, 4));
+        const int bits = littleEndian(file, 28, 2);
+        const std::uint32_t compression = littleEndian(file, 30, 4);
+        const std::uint32_t colorsUsed = littleEndian(file, 46, 4);
+        // A negative height marks rows stored top down instead of bottom up
+        const bool topDown = signedHeight < 0;
+        const std::int64_t height = std::abs(static_cast<std::int64_t>(signedHeight));
+        if (infoSize < 40 || width <= 0 || height == 0 || height > std::numeric_limits<std::int32_t>::max()) {
+            return false;
+        }
+        const bool palettized = (bits == 1 || bits == 4 || bits == 8) && compression == BI_RGB;
+        const bool packed = (bits == 24 && compression == BI_RGB) ||
+            (bits == 32 && (compression == BI_RGB || compression == BI_BITFIELDS || compression == BI_ALPHABITFIELDS));
+        if (!palettized && !packed) {
+            return false;
+        }
+
+        const std::size_t stride = (static_cast<std::size_t>(width) * bits + 31) / 32 * 4;
+        if (pixelOffset > file.size() || (file.size() - pixelOffset) / stride < static_cast<std::size_t>(height)) {
+            return false;
+        }
+
+        // Color table of BGRX entries after the information header
+        std::vector<unsigned char> palette;
+        if (palettized) {
+            const std::size_t entries = colorsUsed ? std::min<std::size_t>(colorsUsed, 1u << bits) : 1u << bits;
+            const std::size_t paletteOffset = 14 + infoSize;
+            if (paletteOffset > file.size() || (file.size() - paletteOffset) / 4 < entries) {
+                return false;
+            }
+            palette.assign(file.begin() + paletteOffset, file.begin() + paletteOffset + 4 * entries);
+        }
+
+        // 32-bit pixels without bitfields are BGRX; the masks of BITFIELDS follow the 40-byte header, inside
+        // the larger V4 and V5 headers
+        std::uint32_t masks[3] = {0x00ff0000, 0x0000ff00, 0x000000ff};
+        if (bits == 32 && compression != BI_RGB) {
+            if (file.size() < 66) {
+                return false;
+            }
+            for (int c = 0; c < 3; c++) {
+                masks[c] = littleEndian(file, 54 + 4 * c, 4);
+            }
+        }
+        const BitField fields[3] = {BitField(masks[0]), BitField(masks[1]), BitField(masks[2])};
+
+        channels.assign(3, ImagePlane(width, static_cast<int>(height)));
+        for (std::int64_t y = 0; y < height; y++) {
+            const unsigned char* row = file.data() + pixelOffset + stride * (topDown ? y : height - 1 - y);
+            double* red = channels[0].row(y);
+            double* green = channels[1].row(y);
+            double* blue = channels[2].row(y);
+            for (std::int32_t x = 0; x < width; x++) {
+                if (palettized) {
+                    const int perByte = 8 / bits;
+                    const std::size_t index =
+                        (row[x / perByte] >> (8 - bits * (x % perByte + 1))) & ((1u << bits) - 1);
+                    if (4 * index >= palette.size()) {
+                        return false;
+                    }
+                    blue[x] = palette[4 * index];
+                    green[x] = palette[4 * index + 1];
+                    red[x] = palette[4 * index + 2];
+                } else if (bits == 24) {
+                    blue[x] = row[3 * x];
+                    green[x] = row[3 * x + 1];
+                    red[x] = row[3 * x + 2];
+                } else {
+                    const std::uint32_t pixel = row[4 * x] | row[4 * x + 1] << 8 | row[4 * x + 2] << 16 |
+                                                static_cast<std::uint32_t>(row[4 * x + 3]) << 24;
+                    red[x] = fields[0](pixel);
+                    green[x] = fields[1](pixel);
+                    blue[x] = fields[2](pixel);
+                }
+            }
+        }
+        collapseGray(channels);
+        return true;
+    }
+
+    // Next decimal number of a PNM header, skipping white space and # comments; false past the end
+    bool headerNumber(const std::vector<unsigned char>& file, std::size_t& position, std::uint32_t& value) {
+        while (position < file.size() && (std::isspace(file[position]) || file[position] == '#')) {
+            if (file[position] == '#') {
+                while (position < file.size() && file[position] != '\n') {
+                    position++;
+                }
+            } else {
+                position++;
+            }
+        }
+        if (position >= file.size() || !std::isdigit(file[position])) {
+            return false;
+        }
+        value = 0;
+        while (position < file.size() && std::isdigit(file[position])) {
+            value = value * 10 + (file[position++] - '0');
+            if (value > 1u << 30) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Binary PGM (P5) or PPM (P6), 8 bits per sample up to a maxval of 255 and 16 bits big endian above
+    bool loadPortable(const std::vector<unsigned char>& file, std::vector<ImagePlane>& channels) {
+        const int planes = file[1] == '5' ? 1 : 3;
+        std::size_t position = 2;
+        std::uint32_t width, height, maxval;
+        if (!headerNumber(file, position, width) || !headerNumber(file, position, height) ||
+            !headerNumber(file, position, maxval) || width == 0 || height == 0 || maxval == 0 || maxval > 65535 ||
+            position >= file.size() || !std::isspace(file[position])) {
+            return false;
+        }
+        // A single white space character separates the header from the samples
+        position++;
+        const std::size_t bytes = maxval < 256 ? 1 : 2;
+        const std::size_t rowBytes = static_cast<std::size_t>(width) * planes * bytes;
+        if ((file.size() - position) / rowBytes < height) {
+            return false;
+        }
+
+        const double scale = 255.0 / maxval;
+        channels.assign(planes, ImagePlane(width, height));
+        for (std::uint32_t y = 0; y < height; y++) {
+            const unsigned char* row = file.data() + position + rowBytes * y;
+            for (std::uint32_t x = 0; x < width; x++) {
+                for (int c = 0; c < planes; c++) {
+                    const unsigned char* sample = row + (x * planes + c) * bytes;
+                    const std::uint32_t value = bytes == 1 ? sample[0] : sample[0] << 8 | sample[1];
+                    channels[c](x, y) = std::min(value, maxval) * scale;
+                }
+            }
+        }
+        collapseGray(channels);
+        return true;
+    }
+
+    bool savePortable(const std::string& path, const std::vector<ImagePlane>& channels, bool color) {
+        if (channels.empty() || (channels.size() != 1 && !(color && channels.size() == 3))) {
+            return false;
+        }
+        const int width = channels[0].width;
+        const int height = channels[0].height;
+        for (const auto& plane : channels) {
+            if (plane.width != width || plane.height != height) {
+                return false;
+            }
+        }
+        const int planes = color ? 3 : 1;
+
+        // The temporary file is removed if it could not be written or renamed
+        std::string temporary = path + ".tmp";
+        bool written;
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            file << (color ? "P6" : "P5") << '\n' << width << ' ' << height << "\n65535\n";
+            std::vector<unsigned char> row(static_cast<std::size_t>(width) * planes * 2);
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    for (int c = 0; c < planes; c++) {
+                        // A single plane fills all three samples of a PPM
+                        const double value = channels[std::min<std::size_t>(c, channels.size() - 1)](x, y);
+                        const auto level = static_cast<std::uint16_t>(
+                            std::lround(std::min(255.0, std::max(0.0, value)) * (65535.0 / 255.0)));
+                        row[(x * planes + c) * 2] = level >> 8;
+                        row[(x * planes + c) * 2 + 1] = level & 0xff;
+                    }
+                }
+                file.write(reinterpret_cast<const char*>(row.data()), row.size());
+            }
+            written = static_cast<bool>(file.flush());
+        }
+        if (!written || std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+}
+
+bool ImageFile::isHighPrecision(const std::string& path) {
+    return PlaneFile::isPlaneFile(path) || hasExtension(path, ".pgm") || hasExtension(path, ".ppm");
+}
+
+bool ImageFile::load(const std::string& path, std::vector<ImagePlane>& channels) {
+    channels.clear();
+    if (PlaneFile::isPlaneFile(path)) {
+        return PlaneFile::load(path, channels);
+    }
+    std::ifstream stream(path, std::ios::binary);
+    const std::vector<unsigned char> file((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+
+    // The format is told by the first bytes rather than the extension
+    bool loaded = false;
+    if (file.size() >= 2 && file[0] == 'B' && file[1] == 'M') {
+        loaded = loadBitmap(file, channels);
+    } else if (file.size() >= 2 && file[0] == 'P' && (file[1] == '5' || file[1] == '6')) {
+        loaded = loadPortable(file, channels);
+    }
+    if (!loaded) {
+        channels.clear();
+    }
+    return loaded;
+}
+
+bool ImageFile::save(const std::string& path, const std::vector<ImagePlane>& channels) {
+    if (PlaneFile::isPlaneFile(path)) {
+        return PlaneFile::save(path, channels);
+    }
+    if (hasExtension(path, ".pgm") || hasExtension(path, ".ppm")) {
+        return savePortable(path, channels, hasExtension(path, ".ppm"));
+    }
+    return false;
+}
@@ -1,9 +1,12 @@
 #include "ImageViewer.hh"
 #include "deconvolution.hh"
 #include "blur_image.hh"
+#include "ImageFile.hh"
+#include "PlaneFile.hh"
+#include <algorithm>
 
 ImageViewer::ImageViewer() : window(nullptr), imageOriginal(nullptr), imageBlurred(nullptr), imageDeblurred(nullptr),
-pixbufOriginal(nullptr), pixbufDeblurred(nullptr), pixbufBlurred(nullptr) {}
+pixbufOriginal(nullptr), pixbufDeblurred(nullptr), pixbufBlurred(nullptr), blurredEventBox(nullptr) {}
 
 void ImageViewer::run(int argc, char* argv[]) {
     GtkApplication* app = gtk_application_new("com.example.image_viewer", G_APPLICATION_FLAGS_NONE);
@@ -21,7 +24,14 @@ void ImageViewer::openImage(GtkWidget* widget, gpointer data) {
 
     if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
         char *filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
-        viewer->bitmapImage = bitmap_image(filename);
+        // Gray, palettized, 32-bit and 16-bit images are read through their channels; a gray one becomes a
+        // gray bitmap, which the blur and the deconvolution then process as a single channel
+        std::vector<ImagePlane> channels;
+        if (ImageFile::load(filename, channels)) {
+            viewer->bitmapImage = PlaneFile::toBitmap(channels);
+        } else {
+            viewer->bitmapImage = bitmap_image(filename);
+        }
         if (viewer->bitmapImage.data()) {
 // Create a GdkPixbuf from the image
             unsigned char *buffer = convertToRGBBuffer(viewer->bitmapImage);
@@ -82,10 +92,22 @@ void ImageViewer::MenuChanged(GtkComboBox* comboBox, gpointer data) {
             viewer->deconvolutionType = DeconvolutionType::RICHARDSON_LUCY_TIKHONOV;
         else if (active == 2)
             viewer->deconvolutionType = DeconvolutionType::RICHARDSON_LUCY_TV;
+        else if (active == 3)
+            viewer->deconvolutionType = DeconvolutionType::WIENER;
+        else if (active == 4)
+            viewer->deconvolutionType = DeconvolutionType::PRIMAL_DUAL_TV;
+        else if (active == 5)
+            viewer->deconvolutionType = DeconvolutionType::ADMM;
     }
     if (viewer->pixbufOriginal == nullptr)
         return;
 
+    // Changing the method while a region is selected only refreshes that region
+    if (comboBox == GTK_COMBO_BOX(viewer->deconvolutionComboBox) && viewer->hasRegion) {
+        deconvolveRegion(viewer);
+        return;
+    }
+
     // Perform the blur operation with the selected blur type and update the image
     // Here, you can use the viewer->blurType to perform the blur operation or pass it to the ImageBlurrer class
     // After blurring, update the image2 and pixbuf2 with the blurred image data
@@ -96,27 +118,20 @@ void ImageViewer::MenuChanged(GtkComboBox* comboBox, gpointer data) {
 
     blurrer.blurImage();
     char* blurredImageFile = "results/blurred_image.bmp";
+    // The deconvolution reads the blurred image unrounded; the bitmap is for display
+    const char* blurredPlaneFile = "results/blurred_image.lpf";
 
     blurrer.saveImage(blurredImageFile);
+    blurrer.saveImage(blurredPlaneFile);
     viewer->kernel = blurrer.getKernel();
 
 
     viewer->pixbufBlurred = gdk_pixbuf_new_from_file(blurredImageFile, nullptr);
     gtk_image_set_from_pixbuf(GTK_IMAGE(viewer->imageBlurred), viewer->pixbufBlurred);
 
-    auto deconvolver = Deconvolver(viewer->kernel, blurredImageFile);
-    switch (viewer->deconvolutionType)
-    {
-        case DeconvolutionType::RICHARDSON_LUCY:
-            deconvolver.deconvolve(viewer->numberOfIterations);
-            break;
-        case DeconvolutionType::RICHARDSON_LUCY_TIKHONOV:
-            deconvolver.deconvolveAuto(viewer->numberOfIterations, 0.1);
-            break;
-        case DeconvolutionType::RICHARDSON_LUCY_TV:
-            deconvolver.deconvolveTV(viewer->numberOfIterations, 1, 0.001, 1);
-            break;
-    }
+    auto deconvolver = Deconvolver(viewer->kernel, blurredPlaneFile);
+    viewer->blurredImage = deconvolver.image;
+    runDeconvolution(deconvolver, viewer->deconvolutionType, viewer->numberOfIterations);
     viewer->deblurredImage = deconvolver.image;
 
     // Create a GdkPixbuf from the restored image
@@ -140,13 +155,162 @@ void ImageViewer::iterationsChanged(GtkRange* range, gpointer data) {
         return;
     g_idle_add([](gpointer data) {
         ImageViewer* viewer = static_cast<ImageViewer*>(data);
-        // call the callback function from menu change
-        MenuChanged(GTK_COMBO_BOX(viewer->blurComboBox), data);
+        // Only iterate on the selected region, otherwise call the callback function from menu change
+        if (viewer->hasRegion)
+            deconvolveRegion(viewer);
+        else
+            MenuChanged(GTK_COMBO_BOX(viewer->blurComboBox), data);
 
         return G_SOURCE_REMOVE;
     }, viewer);
 }
 
+void ImageViewer::runDeconvolution(Deconvolver& deconvolver, DeconvolutionType type, int iterations) {
+    switch (type)
+    {
+        case DeconvolutionType::RICHARDSON_LUCY:
+            deconvolver.deconvolve(iterations);
+            break;
+        case DeconvolutionType::RICHARDSON_LUCY_TIKHONOV:
+            deconvolver.deconvolveAuto(iterations, 0.1);
+            break;
+        case DeconvolutionType::RICHARDSON_LUCY_TV:
+            deconvolver.deconvolveTV(iterations, 1, 0.001, 1);
+            break;
+        case DeconvolutionType::WIENER:
+            // One shot: the iteration count does not apply
+            deconvolver.deconvolveWiener(0.05);
+            break;
+        case DeconvolutionType::PRIMAL_DUAL_TV:
+            deconvolver.deconvolvePrimalDual(iterations, 1.0);
+            break;
+        case DeconvolutionType::ADMM:
+            deconvolver.setBoundary(Convolution::Boundary::MIRROR);
+            deconvolver.deconvolveADMM(iterations, 1.0, 0.01);
+            break;
+    }
+}
+
+void ImageViewer::deconvolveRegion(ImageViewer* viewer) {
+    if (viewer->blurredImage.width() == 0 || viewer->deblurredImage.width() == 0)
+        return;
+
+    int x = std::min(viewer->selectionStartX, viewer->selectionEndX);
+    int y = std::min(viewer->selectionStartY, viewer->selectionEndY);
+    int width = std::abs(viewer->selectionEndX - viewer->selectionStartX);
+    int height = std::abs(viewer->selectionEndY - viewer->selectionStartY);
+
+    DeconvolutionType type = viewer->deconvolutionType;
+    int iterations = viewer->numberOfIterations;
+    Deconvolver deconvolver(viewer->kernel, viewer->blurredImage);
+    bitmap_image crop;
+    if (type == DeconvolutionType::WIENER || type == DeconvolutionType::PRIMAL_DUAL_TV ||
+        type == DeconvolutionType::ADMM) {
+        // The frequency-domain methods make every pixel depend on the whole image, so no halo would give the
+        // full-frame result: the full frame is deconvolved and the region copied out
+        if (width == 0 || height == 0)
+            return;
+        runDeconvolution(deconvolver, type, iterations);
+        deconvolver.image.region(x, y, width, height, crop);
+    } else {
+        crop = deconvolver.deconvolveRegion(x, y, width, height, iterations,
+                                            [type, iterations](Deconvolver& regionDeconvolver) {
+                                                runDeconvolution(regionDeconvolver, type, iterations);
+                                            });
+    }
+    if (crop.width() == 0)
+        return;
+
+    viewer->deblurredImage.copy_from(crop, x, y);
+    showDeblurred(viewer);
+}
+
+void ImageViewer::showDeblurred(ImageViewer* viewer) {
+    unsigned char* buffer = convertToRGBBuffer(viewer->deblurredImage);
+    GdkPixbuf* pixbuf = gdk_pixbuf_new_from_data(buffer, GDK_COLORSPACE_RGB, FALSE, 8, viewer->deblurredImage.width(),
+                                                 viewer->deblurredImage.height(), viewer->deblurredImage.width() * 3,
+                                                 [](guchar* pixels, gpointer) { delete[] pixels; }, nullptr);
+    gtk_image_set_from_pixbuf(GTK_IMAGE(viewer->imageDeblurred), pixbuf);
+    if (viewer->pixbufDeblurred != nullptr)
+        g_object_unref(viewer->pixbufDeblurred);
+    viewer->pixbufDeblurred = pixbuf;
+}
+
+void ImageViewer::widgetToImage(ImageViewer* viewer, double widgetX, double widgetY, int& imageX, int& imageY) {
+    // The image is centered inside its widget
+    GtkAllocation allocation;
+    gtk_widget_get_allocation(viewer->imageBlurred, &allocation);
+    int width = viewer->blurredImage.width();
+    int height = viewer->blurredImage.height();
+    imageX = std::clamp(static_cast<int>(widgetX) - (allocation.width - width) / 2, 0, width);
+    imageY = std::clamp(static_cast<int>(widgetY) - (allocation.height - height) / 2, 0, height);
+}
+
+gboolean ImageViewer::selectionPressed(GtkWidget* widget, GdkEventButton* event, gpointer data) {
+    ImageViewer* viewer = static_cast<ImageViewer*>(data);
+    if (viewer->blurredImage.width() == 0)
+        return FALSE;
+
+    // Right click drops the selection and goes back to full-frame deconvolution
+    if (event->button == 3) {
+        viewer->hasRegion = false;
+        gtk_widget_queue_draw(viewer->imageBlurred);
+        MenuChanged(nullptr, viewer);
+        return TRUE;
+    }
+
+    viewer->selecting = true;
+    widgetToImage(viewer, event->x, event->y, viewer->selectionStartX, viewer->selectionStartY);
+    viewer->selectionEndX = viewer->selectionStartX;
+    viewer->selectionEndY = viewer->selectionStartY;
+    return TRUE;
+}
+
+gboolean ImageViewer::selectionMoved(GtkWidget* widget, GdkEventMotion* event, gpointer data) {
+    ImageViewer* viewer = static_cast<ImageViewer*>(data);
+    if (!viewer->selecting)
+        return FALSE;
+
+    widgetToImage(viewer, event->x, event->y, viewer->selectionEndX, viewer->selectionEndY);
+    gtk_widget_queue_draw(viewer->imageBlurred);
+    return TRUE;
+}
+
+gboolean ImageViewer::selectionReleased(GtkWidget* widget, GdkEventButton* event, gpointer data) {
+    ImageViewer* viewer = static_cast<ImageViewer*>(data);
+    if (!viewer->selecting)
+        return FALSE;
+
+    viewer->selecting = false;
+    widgetToImage(viewer, event->x, event->y, viewer->selectionEndX, viewer->selectionEndY);
+    viewer->hasRegion = std::abs(viewer->selectionEndX - viewer->selectionStartX) > 1 &&
+                        std::abs(viewer->selectionEndY - viewer->selectionStartY) > 1;
+    gtk_widget_queue_draw(viewer->imageBlurred);
+    if (viewer->hasRegion)
+        deconvolveRegion(viewer);
+    return TRUE;
+}
+
+gboolean ImageViewer::drawSelection(GtkWidget* widget, cairo_t* cr, gpointer data) {
+    ImageViewer* viewer = static_cast<ImageViewer*>(data);
+    if (!viewer->selecting && !viewer->hasRegion)
+        return FALSE;
+
+    GtkAllocation allocation;
+    gtk_widget_get_allocation(widget, &allocation);
+    int offsetX = (allocation.width - static_cast<int>(viewer->blurredImage.width())) / 2;
+    int offsetY = (allocation.height - static_cast<int>(viewer->blurredImage.height())) / 2;
+
+    cairo_set_source_rgb(cr, 1.0, 0.0, 0.0);
+    cairo_set_line_width(cr, 1.0);
+    cairo_rectangle(cr, offsetX + std::min(viewer->selectionStartX, viewer->selectionEndX) + 0.5,
+                    offsetY + std::min(viewer->selectionStartY, viewer->selectionEndY) + 0.5,
+                    std::abs(viewer->selectionEndX - viewer->selectionStartX),
+                    std::abs(viewer->selectionEndY - viewer->selectionStartY));
+    cairo_stroke(cr);
+    return FALSE;
+}
+
 void ImageViewer::saveImage(GtkWidget* widget, gpointer data) {
     ImageViewer* viewer = static_cast<ImageViewer*>(data);
     // Perform the image saving logic here
@@ -159,7 +323,11 @@ void ImageViewer::saveImage(GtkWidget* widget, gpointer data) {
     if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
         char* filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
         //save the image
-        viewer->deblurredImage.save_image(filename);
+        if (ImageFile::isHighPrecision(filename)) {
+            ImageFile::save(filename, PlaneFile::fromBitmap(viewer->deblurredImage));
+        } else {
+            viewer->deblurredImage.save_image(filename);
+        }
     }
 
     gtk_widget_destroy(dialog);
@@ -204,7 +372,16 @@ void ImageViewer::activate(GtkApplication* app, gpointer user_data) {
     viewer->imageBlurred = gtk_image_new();
     viewer->imageDeblurred = gtk_image_new();
     gtk_box_pack_start(GTK_BOX(imageBox), viewer->imageOriginal, TRUE, TRUE, 0);
-    gtk_box_pack_start(GTK_BOX(imageBox), viewer->imageBlurred, TRUE, TRUE, 0);
+    // Dragging over the blurred image selects a region to deconvolve on its own
+    viewer->blurredEventBox = gtk_event_box_new();
+    gtk_container_add(GTK_CONTAINER(viewer->blurredEventBox), viewer->imageBlurred);
+    gtk_widget_add_events(viewer->blurredEventBox,
+                          GDK_BUTTON_PRESS_MASK | GDK_BUTTON_RELEASE_MASK | GDK_BUTTON_MOTION_MASK);
+    g_signal_connect(viewer->blurredEventBox, "button-press-event", G_CALLBACK(ImageViewer::selectionPressed), viewer);
+    g_signal_connect(viewer->blurredEventBox, "motion-notify-event", G_CALLBACK(ImageViewer::selectionMoved), viewer);
+    g_signal_connect(viewer->blurredEventBox, "button-release-event", G_CALLBACK(ImageViewer::selectionReleased), viewer);
+    g_signal_connect_after(viewer->imageBlurred, "draw", G_CALLBACK(ImageViewer::drawSelection), viewer);
+    gtk_box_pack_start(GTK_BOX(imageBox), viewer->blurredEventBox, TRUE, TRUE, 0);
     gtk_box_pack_start(GTK_BOX(imageBox), viewer->imageDeblurred, TRUE, TRUE, 0);
 
     GtkWidget* openButton = gtk_button_new_with_label("Open Image");
@@ -219,6 +396,9 @@ void ImageViewer::activate(GtkApplication* app, gpointer user_data) {
     gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(deconvolutionComboBox), "Richardson-Lucy");
     gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(deconvolutionComboBox), "Richardson-Lucy with Tikhonov Regularization");
     gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(deconvolutionComboBox), "Richardson-Lucy with TV Regularization");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(deconvolutionComboBox), "Wiener (one shot)");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(deconvolutionComboBox), "Primal-Dual TV");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(deconvolutionComboBox), "ADMM (TV, Tikhonov, non-negative)");
     gtk_combo_box_set_active(GTK_COMBO_BOX(deconvolutionComboBox), 0);
     g_signal_connect(deconvolutionComboBox, "changed", G_CALLBACK(ImageViewer::MenuChanged), viewer);
     gtk_box_pack_start(GTK_BOX(controlBox), deconvolutionComboBox, FALSE, FALSE, 0);
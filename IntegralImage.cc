@@ -0,0 +1,31 @@
+#include "IntegralImage.hh"
+#include "ParallelUtils.hh"
+
+void IntegralImage::build(const ImagePlane& plane) {
+    planeWidth = plane.width;
+    planeHeight = plane.height;
+    const std::size_t stride = planeWidth + 1;
+    table.assign(stride * (planeHeight + 1), 0.0);
+
+    // Prefix sums along each row, then accumulate the rows downwards one strip of columns at a time
+    ParallelUtils::forStrips(0, planeHeight, [&](std::size_t rowBegin, std::size_t rowEnd) {
+        for (std::size_t y = rowBegin; y < rowEnd; y++) {
+            const double* source = plane.row(y);
+            double* destination = table.data() + (y + 1) * stride;
+            double running = 0.0;
+            for (int x = 0; x < planeWidth; x++) {
+                running += source[x];
+                destination[x + 1] = running;
+            }
+        }
+    }, 8);
+    ParallelUtils::forStrips(1, stride, [&](std::size_t columnBegin, std::size_t columnEnd) {
+        for (int y = 2; y <= planeHeight; y++) {
+            const double* above = table.data() + (y - 1) * stride;
+            double* current = table.data() + y * stride;
+            for (std::size_t x = columnBegin; x < columnEnd; x++) {
+                current[x] += above[x];
+            }
+        }
+    }, 64);
+}
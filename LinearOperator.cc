@@ -0,0 +1,195 @@
+#include "LinearOperator.hh"
+#include "ConvolutionPlanner.hh"
+#include "ParallelUtils.hh"
+#include <algorithm>
+
+namespace {
+    // Target size of one band buffer of the fused update, so the band's planes stay in the core's cache
+    constexpr std::size_t fusedBandBytes = std::size_t(512) << 10;
+
+    // Rows above and below an output row that a correlation with this kernel height and anchor reads
+    int rowsAbove(int anchorY) {
+        return std::max(anchorY, 0);
+    }
+
+    int rowsBelow(int kernelHeight, int anchorY) {
+        return std::max(kernelHeight - 1 - anchorY, 0);
+    }
+}
+
+void LinearOperator::correction(const ImagePlane& numerator, const ImagePlane& estimate, ImagePlane& out,
+                                const ImagePlane* offset) {
+    forward(estimate, blurred);
+    ratio.resize(estimate.width, estimate.height);
+    if (offset) {
+        for (std::size_t p = 0; p < ratio.size(); p++) {
+            ratio.data[p] = numerator.data[p] / (blurred.data[p] + offset->data[p]);
+        }
+    } else {
+        for (std::size_t p = 0; p < ratio.size(); p++) {
+            ratio.data[p] = numerator.data[p] / blurred.data[p];
+        }
+    }
+    adjoint(ratio, out);
+}
+
+void LinearOperator::update(const ImagePlane& numerator, const ImagePlane& estimate, ImagePlane& out,
+                            const ImagePlane* offset) {
+    correction(numerator, estimate, out, offset);
+    for (std::size_t p = 0; p < out.size(); p++) {
+        out.data[p] *= estimate.data[p];
+    }
+}
+
+ConvolutionOperator::ConvolutionOperator(const std::vector<std::vector<double>>& kernel, int anchorX, int anchorY,
+                                         const std::vector<std::vector<double>>& adjointKernel, int adjointAnchorX,
+                                         int adjointAnchorY, int width, int height, Convolution::Algorithm backend,
+                                         Convolution::Boundary boundary,
+                                         std::optional<Convolution::Algorithm> adjointBackend)
+    : boundary(boundary),
+      forwardPass(makePass(kernel, anchorX, anchorY, width, height, backend)),
+      adjointPass(makePass(adjointKernel, adjointAnchorX, adjointAnchorY, width, height,
+                           adjointBackend.value_or(backend))) {}
+
+ConvolutionOperator::Pass ConvolutionOperator::makePass(const std::vector<std::vector<double>>& kernel, int anchorX,
+                                                        int anchorY, int width, int height,
+                                                        Convolution::Algorithm backend) const {
+    Pass pass;
+    pass.kernel = kernel;
+    pass.anchorX = anchorX;
+    pass.anchorY = anchorY;
+    pass.algorithm = backend;
+    if (backend == Convolution::Algorithm::AUTO && !kernel.empty() && !kernel[0].empty()) {
+        const ConvolutionPlanner::Plan plan = ConvolutionPlanner::plan(width, height, kernel, anchorX, anchorY,
+            {Convolution::Algorithm::SPARSE, Convolution::Algorithm::DIRECT, Convolution::Algorithm::SEPARABLE,
+             Convolution::Algorithm::BLOCKED});
+        pass.algorithm = plan.algorithm;
+        pass.layout = plan.layout;
+    }
+    return pass;
+}
+
+void ConvolutionOperator::apply(const Pass& pass, const ImagePlane& x, ImagePlane& out,
+                                Convolution::Workspace& scratch) const {
+    if (pass.kernel.empty() || pass.kernel[0].empty()) {
+        out.resize(x.width, x.height);
+        std::fill(out.data.begin(), out.data.end(), 0.0);
+        return;
+    }
+    Convolution::correlate(x, out, pass.kernel, pass.anchorX, pass.anchorY, scratch, pass.algorithm, boundary,
+                           pass.layout);
+}
+
+void ConvolutionOperator::forward(const ImagePlane& x, ImagePlane& out) {
+    apply(forwardPass, x, out, workspace);
+}
+
+void ConvolutionOperator::adjoint(const ImagePlane& x, ImagePlane& out) {
+    apply(adjointPass, x, out, workspace);
+}
+
+void ConvolutionOperator::correction(const ImagePlane& numerator, const ImagePlane& estimate, ImagePlane& out,
+                                     const ImagePlane* offset) {
+    const int bandRows = fusedBandRows(estimate.width);
+    if (bandRows == 0) {
+        LinearOperator::correction(numerator, estimate, out, offset);
+        return;
+    }
+    fusedCorrection(numerator, estimate, out, offset, bandRows, false);
+}
+
+void ConvolutionOperator::update(const ImagePlane& numerator, const ImagePlane& estimate, ImagePlane& out,
+                                 const ImagePlane* offset) {
+    const int bandRows = fusedBandRows(estimate.width);
+    if (bandRows == 0) {
+        LinearOperator::update(numerator, estimate, out, offset);
+        return;
+    }
+    fusedCorrection(numerator, estimate, out, offset, bandRows, true);
+}
+
+int ConvolutionOperator::fusedBandRows(int width) const {
+    auto local = [](const Pass& pass) {
+        return !pass.kernel.empty() && !pass.kernel[0].empty() &&
+               pass.algorithm != Convolution::Algorithm::FFT && pass.algorithm != Convolution::Algorithm::WINOGRAD;
+    };
+    if (boundary != Convolution::Boundary::ZERO || !local(forwardPass) || !local(adjointPass) || width == 0) {
+        return 0;
+    }
+    // Bands of a cache-sized number of rows. The halo rows of each band are computed twice, so the bands must
+    // be at least four times the halo for that to stay a small part of the work; kernels too tall for that
+    // are compute bound anyway and gain nothing from the saved memory traffic.
+    const int halo = rowsAbove(forwardPass.anchorY) + rowsBelow(forwardPass.kernel[0].size(), forwardPass.anchorY) +
+                     rowsAbove(adjointPass.anchorY) + rowsBelow(adjointPass.kernel[0].size(), adjointPass.anchorY);
+    const int cacheRows = static_cast<int>(fusedBandBytes / (sizeof(double) * width));
+    return 4 * halo <= cacheRows ? std::max(cacheRows, 1) : 0;
+}
+
+void ConvolutionOperator::fusedCorrection(const ImagePlane& numerator, const ImagePlane& estimate, ImagePlane& out,
+                                          const ImagePlane* offset, int bandRows, bool multiply) {
+    const int width = estimate.width;
+    const int height = estimate.height;
+    out.resize(width, height);
+    if (width == 0 || height == 0) {
+        return;
+    }
+
+    // Output rows [y0, y1) read ratio rows [y0 - adjointAbove, y1 + adjointBelow), which read estimate rows
+    // further out by the forward kernel's reach; rows past the image edge are zeros in both passes
+    const int forwardAbove = rowsAbove(forwardPass.anchorY);
+    const int forwardBelow = rowsBelow(forwardPass.kernel[0].size(), forwardPass.anchorY);
+    const int adjointAbove = rowsAbove(adjointPass.anchorY);
+    const int adjointBelow = rowsBelow(adjointPass.kernel[0].size(), adjointPass.anchorY);
+    const int bands = (height + bandRows - 1) / bandRows;
+
+    // Buffers are kept by the first band of each strip, which is the same from one call to the next
+    bandBuffers.resize(bands);
+    bandWorkspaces.resize(bands);
+    ParallelUtils::forStrips(0, bands, [&](std::size_t bandBegin, std::size_t bandEnd) {
+        auto& [input, blurredBand, ratioBand, correctionBand] = bandBuffers[bandBegin];
+        Convolution::Workspace& scratch = bandWorkspaces[bandBegin];
+        for (int band = bandBegin; band < static_cast<int>(bandEnd); band++) {
+            const int y0 = band * bandRows;
+            const int y1 = std::min(height, y0 + bandRows);
+            const int ratioBegin = std::max(0, y0 - adjointAbove);
+            const int ratioEnd = std::min(height, y1 + adjointBelow);
+            const int inputBegin = std::max(0, ratioBegin - forwardAbove);
+            const int inputEnd = std::min(height, ratioEnd + forwardBelow);
+
+            input.resize(width, inputEnd - inputBegin);
+            std::copy(estimate.row(inputBegin), estimate.row(inputBegin) + input.size(), input.data.begin());
+            apply(forwardPass, input, blurredBand, scratch);
+
+            ratioBand.resize(width, ratioEnd - ratioBegin);
+            for (int y = ratioBegin; y < ratioEnd; y++) {
+                const double* numeratorRow = numerator.row(y);
+                const double* blurredRow = blurredBand.row(y - inputBegin);
+                double* ratioRow = ratioBand.row(y - ratioBegin);
+                if (offset) {
+                    const double* offsetRow = offset->row(y);
+                    for (int x = 0; x < width; x++) {
+                        ratioRow[x] = numeratorRow[x] / (blurredRow[x] + offsetRow[x]);
+                    }
+                } else {
+                    for (int x = 0; x < width; x++) {
+                        ratioRow[x] = numeratorRow[x] / blurredRow[x];
+                    }
+                }
+            }
+            apply(adjointPass, ratioBand, correctionBand, scratch);
+
+            for (int y = y0; y < y1; y++) {
+                const double* correctionRow = correctionBand.row(y - ratioBegin);
+                double* outRow = out.row(y);
+                if (multiply) {
+                    const double* estimateRow = estimate.row(y);
+                    for (int x = 0; x < width; x++) {
+                        outRow[x] = correctionRow[x] * estimateRow[x];
+                    }
+                } else {
+                    std::copy(correctionRow, correctionRow + width, outRow);
+                }
+            }
+        }
+    }, 1);
+}
@@ -0,0 +1,201 @@
+#include "ParallelUtils.hh"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace {
+    std::atomic<unsigned int> configuredThreads{0};
+    // Set while the thread runs a strip, so a loop nested in it stays in that thread
+    thread_local bool insideStrip = false;
+
+    // Strips of one forStrips call, taken in turn by the threads working on it. A strip that throws does not
+    // stop the others; the first exception is kept for the calling thread.
+    class Loop {
+    public:
+        Loop(const std::function<void(std::size_t, std::size_t)>& body, std::size_t begin, std::size_t total,
+             std::size_t strips)
+            : body(body), begin(begin), total(total), strips(strips) {}
+
+        // Run strips until none is left
+        void work() {
+            for (std::size_t strip = next++; strip < strips; strip = next++) {
+                std::exception_ptr thrown;
+                try {
+                    body(begin + total * strip / strips, begin + total * (strip + 1) / strips);
+                } catch (...) {
+                    thrown = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                if (thrown && !error) {
+                    error = thrown;
+                }
+                if (++done == strips) {
+                    finished.notify_all();
+                }
+            }
+        }
+
+        // Wait for every strip, then rethrow the first exception of a strip
+        void wait() {
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [this] { return done == strips; });
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+    private:
+        const std::function<void(std::size_t, std::size_t)>& body;
+        const std::size_t begin;
+        const std::size_t total;
+        const std::size_t strips;
+        std::atomic<std::size_t> next{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+        std::size_t done = 0;
+        std::exception_ptr error;
+    };
+
+    // Worker threads kept from one loop to the next instead of being started for every pass. One loop uses
+    // them at a time, the one holding busy; they only ever run strips, so they are always inside one.
+    class WorkerPool {
+    public:
+        std::mutex busy;
+
+        ~WorkerPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        }
+
+        // Offer the loop to at least count workers, starting more if needed; with fewer (the system refused
+        // a thread) the calling thread runs the remaining strips
+        void start(Loop& loop, std::size_t count) {
+            try {
+                while (workers.size() < count) {
+                    workers.emplace_back([this] { work(); });
+                }
+            } catch (const std::system_error&) {
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                current = &loop;
+                generation++;
+            }
+            wake.notify_all();
+        }
+
+        // Withdraw the loop, once every worker that took it has left it
+        void finish() {
+            std::unique_lock<std::mutex> lock(mutex);
+            current = nullptr;
+            idle.wait(lock, [this] { return users == 0; });
+        }
+
+    private:
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable idle;
+        Loop* current = nullptr;
+        std::size_t generation = 0;
+        std::size_t users = 0;
+        bool stopping = false;
+
+        void work() {
+            insideStrip = true;
+            std::size_t seen = 0;
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+                Loop* loop = current;
+                if (!loop) {
+                    continue;
+                }
+                users++;
+                lock.unlock();
+                loop->work();
+                lock.lock();
+                if (--users == 0) {
+                    idle.notify_all();
+                }
+            }
+        }
+    };
+
+    WorkerPool& workerPool() {
+        static WorkerPool pool;
+        return pool;
+    }
+}
+
+unsigned int ParallelUtils::threadCount() {
+    unsigned int count = configuredThreads.load();
+    if (count == 0) {
+        count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    return count;
+}
+
+void ParallelUtils::setThreadCount(unsigned int count) {
+    configuredThreads.store(count);
+}
+
+void ParallelUtils::forStrips(std::size_t begin, std::size_t end,
+                              const std::function<void(std::size_t, std::size_t)>& body, std::size_t minStrip) {
+    if (end <= begin) {
+        return;
+    }
+    std::size_t total = end - begin;
+    std::size_t strips = std::min<std::size_t>(threadCount(), std::max<std::size_t>(1, total / std::max<std::size_t>(1, minStrip)));
+    if (strips <= 1 || insideStrip) {
+        body(begin, end);
+        return;
+    }
+
+    // The pool serves one loop at a time; a loop started meanwhile from another thread gets threads of its
+    // own. Either way the calling thread takes strips too.
+    Loop loop(body, begin, total, strips);
+    WorkerPool& pool = workerPool();
+    std::unique_lock<std::mutex> owner(pool.busy, std::try_to_lock);
+    std::vector<std::thread> helpers;
+    if (owner.owns_lock()) {
+        pool.start(loop, strips - 1);
+    } else {
+        try {
+            for (std::size_t helper = 0; helper + 1 < strips; helper++) {
+                helpers.emplace_back([&loop] {
+                    insideStrip = true;
+                    loop.work();
+                });
+            }
+        } catch (const std::system_error&) {
+        }
+    }
+
+    insideStrip = true;
+    loop.work();
+    insideStrip = false;
+
+    if (owner.owns_lock()) {
+        pool.finish();
+    }
+    for (auto& helper : helpers) {
+        helper.join();
+    }
+    loop.wait();
+}
@@ -0,0 +1,280 @@
+#include "PlaneFile.hh"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+namespace {
+    constexpr char fileMagic[4] = {'L', 'P', 'L', 'F'};
+    constexpr std::int32_t fileVersion = 1;
+    // Largest tile side a file may declare, which bounds the tile buffer
+    constexpr std::int32_t maxTileSize = 4096;
+    constexpr std::uint64_t headerBytes = 32;
+
+    // Header fields after the magic, as 32-bit integers
+    enum Field { VERSION, WIDTH, HEIGHT, CHANNELS, TILE_SIZE, BITS, RESERVED, FIELDS };
+
+    // Copy tile (tx, ty) of a plane out of or into a tileSize x tileSize buffer; outside the plane the
+    // buffer holds zeros on the way out and is ignored on the way in
+    template <typename Sample, typename Convert>
+    void packTile(const ImagePlane& plane, int tx, int ty, int tileSize, std::vector<Sample>& tile, Convert convert) {
+        std::fill(tile.begin(), tile.end(), convert(0.0));
+        const int x0 = tx * tileSize;
+        const int y0 = ty * tileSize;
+        const int columns = std::min(tileSize, plane.width - x0);
+        const int rows = std::min(tileSize, plane.height - y0);
+        for (int y = 0; y < rows; y++) {
+            const double* source = plane.row(y0 + y) + x0;
+            for (int x = 0; x < columns; x++) {
+                tile[y * tileSize + x] = convert(source[x]);
+            }
+        }
+    }
+
+    template <typename Sample, typename Convert>
+    void unpackTile(const std::vector<Sample>& tile, int tx, int ty, int tileSize, ImagePlane& plane, Convert convert) {
+        const int x0 = tx * tileSize;
+        const int y0 = ty * tileSize;
+        const int columns = std::min(tileSize, plane.width - x0);
+        const int rows = std::min(tileSize, plane.height - y0);
+        for (int y = 0; y < rows; y++) {
+            double* target = plane.row(y0 + y) + x0;
+            for (int x = 0; x < columns; x++) {
+                target[x] = convert(tile[y * tileSize + x]);
+            }
+        }
+    }
+
+    template <typename Sample, typename Convert>
+    bool writeChannels(std::ofstream& file, const std::vector<ImagePlane>& channels, int tileSize, Convert convert) {
+        std::vector<Sample> tile(static_cast<std::size_t>(tileSize) * tileSize);
+        for (const auto& plane : channels) {
+            const int tilesX = (plane.width + tileSize - 1) / tileSize;
+            const int tilesY = (plane.height + tileSize - 1) / tileSize;
+            for (int ty = 0; ty < tilesY; ty++) {
+                for (int tx = 0; tx < tilesX; tx++) {
+                    packTile(plane, tx, ty, tileSize, tile, convert);
+                    file.write(reinterpret_cast<const char*>(tile.data()), tile.size() * sizeof(Sample));
+                }
+            }
+        }
+        return static_cast<bool>(file);
+    }
+
+    template <typename Sample, typename Convert>
+    bool readChannels(std::ifstream& file, std::vector<ImagePlane>& channels, int tileSize, Convert convert) {
+        std::vector<Sample> tile(static_cast<std::size_t>(tileSize) * tileSize);
+        for (auto& plane : channels) {
+            const int tilesX = (plane.width + tileSize - 1) / tileSize;
+            const int tilesY = (plane.height + tileSize - 1) / tileSize;
+            for (int ty = 0; ty < tilesY; ty++) {
+                for (int tx = 0; tx < tilesX; tx++) {
+                    if (!file.read(reinterpret_cast<char*>(tile.data()), tile.size() * sizeof(Sample))) {
+                        return false;
+                    }
+                    unpackTile(tile, tx, ty, tileSize, plane, convert);
+                }
+            }
+        }
+        return true;
+    }
+
+    // Bitmap pixel of the channels at (x, y), with the truncation the stages have always used
+    rgb_t pixel(const std::vector<ImagePlane>& channels, int x, int y) {
+        auto level = [](double value) {
+            return static_cast<unsigned char>(std::min(255.0, std::max(0.0, value)));
+        };
+        rgb_t color;
+        color.red = level(channels[0](x, y));
+        color.green = channels.size() < 3 ? color.red : level(channels[1](x, y));
+        color.blue = channels.size() < 3 ? color.red : level(channels[2](x, y));
+        return color;
+    }
+}
+
+bool PlaneFile::isPlaneFile(const std::string& path) {
+    const std::string suffix = extension;
+    return path.size() >= suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool PlaneFile::save(const std::string& path, const std::vector<ImagePlane>& channels, Format format, int tileSize) {
+    tileSize = std::clamp(tileSize, 1, static_cast<int>(maxTileSize));
+    std::int32_t header[FIELDS] = {};
+    header[VERSION] = fileVersion;
+    header[WIDTH] = channels.empty() ? 0 : channels[0].width;
+    header[HEIGHT] = channels.empty() ? 0 : channels[0].height;
+    header[CHANNELS] = channels.size();
+    header[TILE_SIZE] = tileSize;
+    header[BITS] = format == Format::FLOAT16 ? 16 : 32;
+    for (const auto& plane : channels) {
+        if (plane.width != header[WIDTH] || plane.height != header[HEIGHT]) {
+            return false;
+        }
+    }
+
+    // Written under a temporary name and renamed, so a reader never sees half a file; the temporary is
+    // removed if either step fails
+    std::string temporary = path + ".tmp";
+    bool written;
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file.write(fileMagic, 4);
+        file.write(reinterpret_cast<const char*>(header), sizeof(header));
+        written = format == Format::FLOAT16
+            ? writeChannels<std::uint16_t>(file, channels, tileSize,
+                                           [](double value) { return toHalf(static_cast<float>(value)); })
+            : writeChannels<float>(file, channels, tileSize,
+                                   [](double value) { return static_cast<float>(value); });
+        written = written && file.flush();
+    }
+    if (!written || std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool PlaneFile::load(const std::string& path, std::vector<ImagePlane>& channels) {
+    channels.clear();
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    const std::streamoff fileBytes = file.tellg();
+    file.seekg(0);
+    char magic[4];
+    std::int32_t header[FIELDS];
+    if (!file.read(magic, 4) || std::memcmp(magic, fileMagic, 4) != 0 ||
+        !file.read(reinterpret_cast<char*>(header), sizeof(header)) || header[VERSION] != fileVersion ||
+        header[WIDTH] < 0 || header[HEIGHT] < 0 || header[CHANNELS] < 0 || header[TILE_SIZE] <= 0 ||
+        header[TILE_SIZE] > maxTileSize || (header[BITS] != 16 && header[BITS] != 32)) {
+        return false;
+    }
+
+    // Nothing is allocated before the header is known to describe exactly the samples the file holds, so a
+    // damaged or hostile header cannot ask for more memory than the file size. The product is checked
+    // factor by factor against the payload, which keeps it from overflowing.
+    const std::uint64_t tileSize = header[TILE_SIZE];
+    const std::uint64_t payload = static_cast<std::uint64_t>(fileBytes) - headerBytes;
+    std::uint64_t expected = tileSize * tileSize * (header[BITS] / 8);
+    const std::uint64_t factors[] = {(header[WIDTH] + tileSize - 1) / tileSize,
+                                     (header[HEIGHT] + tileSize - 1) / tileSize,
+                                     static_cast<std::uint64_t>(header[CHANNELS])};
+    for (std::uint64_t factor : factors) {
+        if (factor != 0 && expected > payload / factor) {
+            return false;
+        }
+        expected *= factor;
+    }
+    if (expected != payload) {
+        return false;
+    }
+
+    channels.assign(header[CHANNELS], ImagePlane(header[WIDTH], header[HEIGHT]));
+    bool read = header[BITS] == 16
+        ? readChannels<std::uint16_t>(file, channels, header[TILE_SIZE],
+                                      [](std::uint16_t half) { return static_cast<double>(fromHalf(half)); })
+        : readChannels<float>(file, channels, header[TILE_SIZE],
+                              [](float value) { return static_cast<double>(value); });
+    if (!read) {
+        channels.clear();
+    }
+    return read;
+}
+
+std::vector<ImagePlane> PlaneFile::fromBitmap(const bitmap_image& image) {
+    std::vector<ImagePlane> channels(3, ImagePlane(image.width(), image.height()));
+    for (unsigned int y = 0; y < image.height(); y++) {
+        for (unsigned int x = 0; x < image.width(); x++) {
+            rgb_t color = image.get_pixel(x, y);
+            channels[0](x, y) = color.red;
+            channels[1](x, y) = color.green;
+            channels[2](x, y) = color.blue;
+        }
+    }
+    if (channels[0].data == channels[1].data && channels[0].data == channels[2].data) {
+        channels.resize(1);
+    }
+    return channels;
+}
+
+bitmap_image PlaneFile::toBitmap(const std::vector<ImagePlane>& channels) {
+    if (channels.empty()) {
+        return bitmap_image();
+    }
+    bitmap_image image(channels[0].width, channels[0].height);
+    for (int y = 0; y < channels[0].height; y++) {
+        for (int x = 0; x < channels[0].width; x++) {
+            image.set_pixel(x, y, pixel(channels, x, y));
+        }
+    }
+    return image;
+}
+
+bool PlaneFile::matches(const std::vector<ImagePlane>& channels, const bitmap_image& image) {
+    if (channels.empty() || channels[0].width != static_cast<int>(image.width()) ||
+        channels[0].height != static_cast<int>(image.height())) {
+        return false;
+    }
+    for (int y = 0; y < channels[0].height; y++) {
+        for (int x = 0; x < channels[0].width; x++) {
+            rgb_t expected = pixel(channels, x, y);
+            rgb_t actual = image.get_pixel(x, y);
+            if (expected.red != actual.red || expected.green != actual.green || expected.blue != actual.blue) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+std::uint16_t PlaneFile::toHalf(float value) {
+    const std::uint32_t bits = std::bit_cast<std::uint32_t>(value);
+    const std::uint16_t sign = (bits >> 16) & 0x8000;
+    const int exponent = static_cast<int>((bits >> 23) & 0xff);
+    std::uint32_t mantissa = bits & 0x7fffff;
+
+    if (exponent == 0xff) {
+        // Infinity, or NaN with a quiet bit so it stays NaN
+        return sign | 0x7c00 | (mantissa ? 0x200 | (mantissa >> 13) : 0);
+    }
+    const int halfExponent = exponent - 127 + 15;
+    if (halfExponent >= 0x1f) {
+        return sign | 0x7c00;
+    }
+    if (halfExponent <= 0) {
+        // Subnormal half, or zero below half the smallest subnormal
+        if (halfExponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        const int shift = 14 - halfExponent;
+        std::uint32_t half = mantissa >> shift;
+        const std::uint32_t remainder = mantissa & ((1u << shift) - 1);
+        const std::uint32_t halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (half & 1))) {
+            half++;
+        }
+        return sign | half;
+    }
+    // A carry out of the mantissa moves to the next exponent, up to infinity, as it should
+    std::uint32_t half = (static_cast<std::uint32_t>(halfExponent) << 10) | (mantissa >> 13);
+    const std::uint32_t remainder = mantissa & 0x1fff;
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+        half++;
+    }
+    return sign | half;
+}
+
+float PlaneFile::fromHalf(std::uint16_t half) {
+    const std::uint32_t sign = static_cast<std::uint32_t>(half & 0x8000) << 16;
+    const int exponent = (half >> 10) & 0x1f;
+    const std::uint32_t mantissa = half & 0x3ff;
+    if (exponent == 0) {
+        float magnitude = std::ldexp(static_cast<float>(mantissa), -24);
+        return sign ? -magnitude : magnitude;
+    }
+    if (exponent == 0x1f) {
+        return std::bit_cast<float>(sign | 0x7f800000 | (mantissa << 13));
+    }
+    return std::bit_cast<float>(sign | (static_cast<std::uint32_t>(exponent - 15 + 127) << 23) | (mantissa << 13));
+}
@@ -0,0 +1,68 @@
+#include "PoissonSampler.hh"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+PoissonSampler::PoissonSampler(double photonScale) : photonScale(photonScale) {
+    if (!(photonScale > 0.0)) {
+        throw std::invalid_argument("Photon scale must be positive.");
+    }
+    for (int value = 0; value < 256; value++) {
+        Sampler& sampler = samplers[value];
+        double mean = value * photonScale;
+        sampler.mean = mean;
+
+        if (mean < tableLimit) {
+            // Accumulate the probabilities until the tail is negligible
+            sampler.table = true;
+            double probability = std::exp(-mean);
+            double cumulative = 0.0;
+            for (int k = 0; cumulative < 1.0 - 1e-15 && k < 1000; k++) {
+                cumulative += probability;
+                sampler.cdf.push_back(cumulative);
+                sampler.outputs.push_back(toIntensity(k));
+                probability *= mean / (k + 1);
+            }
+            sampler.cdf.back() = 1.0;
+        } else {
+            sampler.table = false;
+            double sqrtMean = std::sqrt(mean);
+            sampler.logMean = std::log(mean);
+            sampler.b = 0.931 + 2.53 * sqrtMean;
+            sampler.a = -0.059 + 0.02483 * sampler.b;
+            sampler.logInvAlpha = std::log(1.1239 + 1.1328 / (sampler.b - 3.4));
+            sampler.vr = 0.9277 - 3.6224 / (sampler.b - 2);
+        }
+    }
+}
+
+unsigned char PoissonSampler::toIntensity(double photons) const {
+    // Round half to even so that coarse scales do not bias the mean upwards
+    return static_cast<unsigned char>(std::min(255.0, std::nearbyint(photons / photonScale)));
+}
+
+unsigned char PoissonSampler::sampleFromTable(unsigned char value, double uniform) const {
+    const Sampler& sampler = samplers[value];
+    std::size_t k = std::upper_bound(sampler.cdf.begin(), sampler.cdf.end(), uniform) - sampler.cdf.begin();
+    return sampler.outputs[std::min(k, sampler.outputs.size() - 1)];
+}
+
+unsigned char PoissonSampler::sampleByRejection(unsigned char value, CounterRng::Stream& generator) const {
+    const Sampler& sampler = samplers[value];
+    while (true) {
+        double u = CounterRng::toUniform(generator()) - 0.5;
+        double v = CounterRng::toUniform(generator());
+        double us = 0.5 - std::abs(u);
+        double k = std::floor((2 * sampler.a / us + sampler.b) * u + sampler.mean + 0.43);
+        if (us >= 0.07 && v <= sampler.vr) {
+            return toIntensity(k);
+        }
+        if (k < 0 || (us < 0.013 && v > us)) {
+            continue;
+        }
+        if (std::log(v) + sampler.logInvAlpha - std::log(sampler.a / (us * us) + sampler.b) <=
+            -sampler.mean + k * sampler.logMean - std::lgamma(k + 1)) {
+            return toIntensity(k);
+        }
+    }
+}
@@ -0,0 +1,242 @@
+#include "PsfSpectrumCache.hh"
+#include "Convolution.hh"
+#include "FFT.hh"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <list>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+namespace {
+    using Kernel = std::vector<std::vector<double>>;
+    using Spectrum = PsfSpectrumCache::Spectrum;
+
+    struct Entry {
+        std::string key;
+        Kernel kernel;
+        std::shared_ptr<const Spectrum> spectrum;
+    };
+
+    std::mutex cacheMutex;
+    // Most recently used first
+    std::list<Entry> entries;
+    std::map<std::string, std::list<Entry>::iterator> entryIndex;
+    std::size_t usedBytes = 0;
+    std::size_t capacityBytes = std::size_t(256) << 20;
+    std::string diskDirectory;
+    PsfSpectrumCache::Metrics counters;
+
+    constexpr char fileMagic[4] = {'L', 'P', 'S', 'F'};
+
+    std::size_t entryBytes(const Spectrum& spectrum) {
+        return spectrum.size() * sizeof(std::complex<double>);
+    }
+
+    void evict() {
+        while (usedBytes > capacityBytes && entries.size() > 1) {
+            usedBytes -= entryBytes(*entries.back().spectrum);
+            entryIndex.erase(entries.back().key);
+            entries.pop_back();
+        }
+    }
+
+    void insert(const std::string& key, const Kernel& kernel, std::shared_ptr<const Spectrum> spectrum) {
+        usedBytes += entryBytes(*spectrum);
+        auto found = entryIndex.find(key);
+        if (found != entryIndex.end()) {
+            // A hash collision with another kernel: the newer one takes over the entry, so the key never
+            // indexes two of them
+            usedBytes -= entryBytes(*found->second->spectrum);
+            entries.splice(entries.begin(), entries, found->second);
+            entries.front().kernel = kernel;
+            entries.front().spectrum = std::move(spectrum);
+        } else {
+            entries.push_front({key, kernel, std::move(spectrum)});
+            entryIndex[key] = entries.begin();
+        }
+        evict();
+    }
+
+    std::shared_ptr<const Spectrum> findInMemory(const std::string& key, const Kernel& kernel) {
+        auto found = entryIndex.find(key);
+        // The kernel is compared as well, so a hash collision is a miss rather than a wrong spectrum
+        if (found == entryIndex.end() || found->second->kernel != kernel) {
+            return nullptr;
+        }
+        entries.splice(entries.begin(), entries, found->second);
+        return found->second->spectrum;
+    }
+
+    Spectrum computeSpectrum(const Kernel& kernel, int anchorX, int anchorY, int paddedWidth, int paddedHeight) {
+        // Correlating with the kernel is convolving with the point spread function psf(d) = kernel[anchor - d]
+        Spectrum psf(static_cast<std::size_t>(paddedWidth) * paddedHeight);
+        for (std::size_t i = 0; i < kernel.size(); i++) {
+            for (std::size_t j = 0; j < kernel[i].size(); j++) {
+                int px = ((anchorX - static_cast<int>(i)) % paddedWidth + paddedWidth) % paddedWidth;
+                int py = ((anchorY - static_cast<int>(j)) % paddedHeight + paddedHeight) % paddedHeight;
+                psf[static_cast<std::size_t>(py) * paddedWidth + px] += kernel[i][j];
+            }
+        }
+        FFT::transform2D(psf, paddedWidth, paddedHeight, false);
+        return psf;
+    }
+
+    // On-disk layout: magic, then kernel width, kernel height, anchorX, anchorY, paddedWidth, paddedHeight as
+    // 32-bit integers, the kernel entries and the spectrum as doubles, all in native byte order
+    bool readFromDisk(const std::string& path, const Kernel& kernel, const int header[6], Spectrum& spectrum) {
+        std::ifstream file(path, std::ios::binary);
+        char magic[4];
+        std::int32_t stored[6];
+        if (!file.read(magic, 4) || std::memcmp(magic, fileMagic, 4) != 0 ||
+            !file.read(reinterpret_cast<char*>(stored), sizeof(stored))) {
+            return false;
+        }
+        for (int k = 0; k < 6; k++) {
+            if (stored[k] != header[k]) {
+                return false;
+            }
+        }
+        for (const auto& column : kernel) {
+            std::vector<double> storedColumn(column.size());
+            if (!file.read(reinterpret_cast<char*>(storedColumn.data()), storedColumn.size() * sizeof(double)) ||
+                storedColumn != column) {
+                return false;
+            }
+        }
+        spectrum.resize(static_cast<std::size_t>(header[4]) * header[5]);
+        return static_cast<bool>(file.read(reinterpret_cast<char*>(spectrum.data()), entryBytes(spectrum)));
+    }
+
+    void writeToDisk(const std::string& path, const Kernel& kernel, const int header[6], const Spectrum& spectrum) {
+        // Written under a temporary name of the thread's own and renamed, so a concurrent reader never sees
+        // half a file, nor do two writers share one; the temporary is removed if either step fails
+        std::ostringstream temporaryName;
+        temporaryName << path << "." << std::this_thread::get_id() << ".tmp";
+        const std::string temporary = temporaryName.str();
+        bool written;
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            std::int32_t stored[6];
+            for (int k = 0; k < 6; k++) {
+                stored[k] = header[k];
+            }
+            file.write(fileMagic, 4);
+            file.write(reinterpret_cast<const char*>(stored), sizeof(stored));
+            for (const auto& column : kernel) {
+                file.write(reinterpret_cast<const char*>(column.data()), column.size() * sizeof(double));
+            }
+            file.write(reinterpret_cast<const char*>(spectrum.data()), entryBytes(spectrum));
+            written = static_cast<bool>(file.flush());
+        }
+        if (!written || std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::remove(temporary.c_str());
+        }
+    }
+}
+
+std::uint64_t PsfSpectrumCache::hashKernel(const std::vector<std::vector<double>>& kernel) {
+    std::uint64_t hash = 14695981039346656037ull;
+    auto mix = [&](const void* data, std::size_t bytes) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        for (std::size_t k = 0; k < bytes; k++) {
+            hash = (hash ^ p[k]) * 1099511628211ull;
+        }
+    };
+    std::uint64_t width = kernel.size();
+    mix(&width, sizeof(width));
+    for (const auto& column : kernel) {
+        std::uint64_t height = column.size();
+        mix(&height, sizeof(height));
+        mix(column.data(), column.size() * sizeof(double));
+    }
+    return hash;
+}
+
+std::shared_ptr<const PsfSpectrumCache::Spectrum> PsfSpectrumCache::spectrum(const std::vector<std::vector<double>>& kernel,
+                                                                           int anchorX, int anchorY, int paddedWidth,
+                                                                           int paddedHeight) {
+    std::ostringstream name;
+    name << std::hex << std::setw(16) << std::setfill('0') << hashKernel(kernel) << std::dec << "-" << paddedWidth
+         << "x" << paddedHeight << "-" << anchorX << "_" << anchorY;
+    const std::string key = name.str();
+
+    std::string path;
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        if (auto cached = findInMemory(key, kernel)) {
+            counters.memoryHits++;
+            return cached;
+        }
+        path = diskDirectory.empty() ? "" : diskDirectory + "/" + key + ".psf";
+    }
+
+    // The disk read or the transform runs without the lock, so other kernels are served meanwhile
+    const int kw = kernel.size();
+    const int kh = kernel.empty() ? 0 : kernel[0].size();
+    const int header[6] = {kw, kh, anchorX, anchorY, paddedWidth, paddedHeight};
+    Spectrum computed;
+    const bool fromDisk = !path.empty() && readFromDisk(path, kernel, header, computed);
+    if (!fromDisk) {
+        computed = computeSpectrum(kernel, anchorX, anchorY, paddedWidth, paddedHeight);
+    }
+
+    // A thread that looked the same spectrum up meanwhile may have stored it first; its entry stands, so
+    // every caller shares one copy
+    std::shared_ptr<const Spectrum> spectrum;
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        (fromDisk ? counters.diskHits : counters.misses)++;
+        spectrum = findInMemory(key, kernel);
+        if (spectrum) {
+            return spectrum;
+        }
+        spectrum = std::make_shared<const Spectrum>(std::move(computed));
+        insert(key, kernel, spectrum);
+    }
+    if (!fromDisk && !path.empty()) {
+        writeToDisk(path, kernel, header, *spectrum);
+    }
+    return spectrum;
+}
+
+std::shared_ptr<const PsfSpectrumCache::Spectrum> PsfSpectrumCache::laplacianSpectrum(int paddedWidth, int paddedHeight) {
+    Kernel laplacian(3, std::vector<double>(3));
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            laplacian[i][j] = Convolution::laplacian[i][j];
+        }
+    }
+    return spectrum(laplacian, 1, 1, paddedWidth, paddedHeight);
+}
+
+void PsfSpectrumCache::setDiskDirectory(const std::string& path) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    diskDirectory = path;
+}
+
+void PsfSpectrumCache::setCapacity(std::size_t bytes) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    capacityBytes = bytes;
+    evict();
+}
+
+PsfSpectrumCache::Metrics PsfSpectrumCache::metrics() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return counters;
+}
+
+void PsfSpectrumCache::resetMetrics() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    counters = Metrics();
+}
+
+void PsfSpectrumCache::clear() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    entries.clear();
+    entryIndex.clear();
+    usedBytes = 0;
+}
@@ -0,0 +1,75 @@
+#include "blur_image.hh"
+#include "CounterRng.hh"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// denoiseImage against the median of each window taken by sorting, on sampled pixels. Windows of radius 3
+// and 150 both go through the histogram filter; the second holds up to 301 x 301 pixels, more than a
+// 16-bit count holds.
+int main() {
+    const int width = 300;
+    const int height = 260;
+    bitmap_image source(width, height);
+    CounterRng rng(7);
+    // Mostly flat with 10% random pixels, so one histogram bin takes most of a window: with 16-bit counts,
+    // that bin wrapped and the median search ran off the end of the histogram
+    std::vector<double> uniforms(4 * width * height);
+    rng.uniforms(0, uniforms.size(), 0, uniforms.data());
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const double* sample = &uniforms[4 * (y * width + x)];
+            if (sample[3] < 0.9) {
+                source.set_pixel(x, y, 100, 100, 100);
+            } else {
+                source.set_pixel(x, y, static_cast<unsigned char>(256 * sample[0]),
+                                 static_cast<unsigned char>(256 * sample[1]),
+                                 static_cast<unsigned char>(256 * sample[2]));
+            }
+        }
+    }
+
+    bool passed = true;
+    for (int radius : {3, 150}) {
+        ImageBlurrer blurrer(ImageBlurrer::BLUR_NONE, 1);
+        blurrer.loadImage(source);
+        blurrer.denoiseImage(2 * radius + 1);
+        const std::string path = "median_check.bmp";
+        blurrer.saveImage(path);
+        bitmap_image denoised(path);
+        std::remove(path.c_str());
+
+        int mismatches = 0;
+        for (int y = 0; y < height; y += 37) {
+            for (int x = 0; x < width; x += 23) {
+                // Median of the in-bounds part of the window: the element at half the count in sorted order
+                std::vector<unsigned char> window[3];
+                for (int yj = std::max(0, y - radius); yj <= std::min(height - 1, y + radius); yj++) {
+                    for (int xi = std::max(0, x - radius); xi <= std::min(width - 1, x + radius); xi++) {
+                        rgb_t pixel = source.get_pixel(xi, yj);
+                        window[0].push_back(pixel.red);
+                        window[1].push_back(pixel.green);
+                        window[2].push_back(pixel.blue);
+                    }
+                }
+                unsigned char expected[3];
+                for (int c = 0; c < 3; c++) {
+                    std::nth_element(window[c].begin(), window[c].begin() + window[c].size() / 2, window[c].end());
+                    expected[c] = window[c][window[c].size() / 2];
+                }
+                rgb_t pixel = denoised.get_pixel(x, y);
+                if (pixel.red != expected[0] || pixel.green != expected[1] || pixel.blue != expected[2]) {
+                    mismatches++;
+                }
+            }
+        }
+        std::printf("radius %d: %d mismatched pixels\n", radius, mismatches);
+        passed = passed && mismatches == 0;
+    }
+    if (!passed) {
+        std::printf("FAILED: denoiseImage differs from the sorted window median\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,54 @@
+#include "Convolution.hh"
+#include "CounterRng.hh"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <vector>
+
+// Winograd F(2x2, 3x3) against the direct sum on random images and kernels. The two only differ by
+// rounding, so the largest absolute difference must stay far below one gray level.
+int main() {
+    // Samples on the 0..255 scale and weights in [-1, 1): a sum of nine terms is at most about 2300, and
+    // rounding of the transforms costs a few ulps of that
+    const double tolerance = 1e-9;
+    // Odd and even sizes, so the partial tiles on the right and bottom edges are covered
+    const int sizes[][2] = {{1, 1}, {2, 3}, {7, 5}, {64, 48}, {101, 67}, {640, 481}};
+
+    CounterRng rng(2024);
+    double worst = 0.0;
+    for (std::uint32_t trial = 0; trial < std::size(sizes); trial++) {
+        const int width = sizes[trial][0];
+        const int height = sizes[trial][1];
+        ImagePlane in(width, height);
+        rng.uniforms(0, in.size(), 2 * trial, in.data.data());
+        for (double& value : in.data) {
+            value *= 255.0;
+        }
+        double weights[9];
+        rng.uniforms(0, 9, 2 * trial + 1, weights);
+        std::vector<std::vector<double>> kernel(3, std::vector<double>(3));
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                kernel[i][j] = 2.0 * weights[3 * i + j] - 1.0;
+            }
+        }
+
+        ImagePlane direct, winograd;
+        Convolution::correlate(in, direct, kernel, 1, 1, Convolution::Algorithm::DIRECT);
+        Convolution::correlate(in, winograd, kernel, 1, 1, Convolution::Algorithm::WINOGRAD);
+        double difference = 0.0;
+        for (std::size_t p = 0; p < in.size(); p++) {
+            difference = std::max(difference, std::abs(winograd.data[p] - direct.data[p]));
+        }
+        std::printf("%dx%d: max difference %g\n", width, height, difference);
+        worst = std::max(worst, difference);
+    }
+
+    if (!(worst <= tolerance)) {
+        std::printf("FAILED: Winograd differs from the direct sum by %g (tolerance %g)\n", worst, tolerance);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,240 +1,656 @@
 #include "deconvolution.hh"
 #include "DeconvolutionUtils.hh"
-
+#include "FFT.hh"
+#include "ImageFile.hh"
+#include "PlaneFile.hh"
+#include "PsfSpectrumCache.hh"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+
+namespace {
+    // Penalty of the ADMM splits
+    constexpr double admmPenalty = 0.5;
+
+    // Laplacian {{0, -1, 0}, {-1, 4, -1}, {0, -1, 0}} as convolve() has always applied it: entry [i][j] reads
+    // image[x - i / 2][y - j / 2], which folds the taps onto the pixel itself and its left and upper neighbours
+    constexpr Convolution::Stencil<3> laplacianTaps = {{{0, -1, 0}, {-1, 2, 0}, {0, 0, 0}}};
+}
 
 Deconvolver::Deconvolver(const std::vector<std::vector<double>>& kernel) : kernel(kernel) {}
 
 void Deconvolver::loadImage(const std::string& filePath) {
+    if (ImageFile::load(filePath, exactChannels)) {
+        image = PlaneFile::toBitmap(exactChannels);
+        return;
+    }
     image = bitmap_image(filePath);
+    exactChannels.clear();
 }
 
 
 void Deconvolver::saveImage(const std::string& filePath) {
+    if (ImageFile::isHighPrecision(filePath)) {
+        ImageFile::save(filePath, PlaneFile::matches(exactChannels, image) ? exactChannels : PlaneFile::fromBitmap(image));
+        return;
+    }
     image.save_image(filePath);
 }
 
-std::vector<std::vector<double>> Deconvolver::convolve(const std::vector<std::vector<double>>& image, const std::vector<std::vector<double>>& kernel) {
-    // Create a new image filled with zeros
-    std::vector<std::vector<double>> newImage(image.size(), std::vector<double>(image[0].size(), 0));
-
-    // For each pixel of the image
-    for (std::size_t x = 0; x < image.size(); x++) {
-        for (std::size_t y = 0; y < image[x].size(); y++) {
-            // For each value of the kernel
-            for (std::size_t i = 0; i < kernel.size(); i++) {
-                for (std::size_t j = 0; j < kernel[i].size(); j++) {
-                    // Compute the corresponding position in the image
-                    int xi = x - i / 2;
-                    int yj = y - j / 2;
-                    // Check if the position is inside the image
-                    if (xi >= 0 && xi < image.size() && yj >= 0 && yj < image[xi].size()) {
-                        newImage[x][y] += image[xi][yj] * kernel[i][j];
-                    }
-                }
-            }
+std::vector<std::vector<double>> Deconvolver::foldKernel(const std::vector<std::vector<double>>& kernel) {
+    // Entries [i][j] that read the same pixel are summed; the result is a dense kernel anchored at its last entry
+    std::size_t width = (kernel.size() + 1) / 2;
+    std::size_t height = kernel.empty() ? 0 : (kernel[0].size() + 1) / 2;
+    std::vector<std::vector<double>> folded(width, std::vector<double>(height, 0.0));
+    for (std::size_t i = 0; i < kernel.size(); i++) {
+        for (std::size_t j = 0; j < kernel[i].size(); j++) {
+            folded[width - 1 - i / 2][height - 1 - j / 2] += kernel[i][j];
         }
     }
+    return folded;
+}
 
-    return newImage;
+std::unique_ptr<ConvolutionOperator> Deconvolver::blurOperator(int width, int height,
+                                                              Convolution::Algorithm forwardBackend,
+                                                              Convolution::Algorithm adjointBackend,
+                                                              Convolution::Boundary boundary) const {
+    // The RL methods have always read image[x - i / 2][y - j / 2] for kernel entry [i][j], and the same with
+    // the flipped kernel for the adjoint. Entries that read the same pixel are folded together, anchored at
+    // the last entry, and the backend correlates with the result.
+    std::vector<std::vector<double>> folded = foldKernel(kernel);
+    std::vector<std::vector<double>> foldedFlipped = foldKernel(flipKernel(kernel));
+    int anchorX = std::max<int>(folded.size(), 1) - 1;
+    int anchorY = folded.empty() ? 0 : std::max<int>(folded[0].size(), 1) - 1;
+    return std::make_unique<ConvolutionOperator>(folded, anchorX, anchorY, foldedFlipped, anchorX, anchorY, width,
+                                                 height, forwardBackend, boundary, adjointBackend);
 }
 
-void Deconvolver::deconvolve(int iterations) {
-    std::vector<std::vector<double>> redImage(image.width(), std::vector<double>(image.height()));
-    std::vector<std::vector<double>> greenImage(image.width(), std::vector<double>(image.height()));
-    std::vector<std::vector<double>> blueImage(image.width(), std::vector<double>(image.height()));
-
-    for (std::size_t x = 0; x < image.width(); x++) {
-        for (std::size_t y = 0; y < image.height(); y++) {
-            rgb_t color = image.get_pixel(x, y);
-            redImage[x][y] = color.red;
-            greenImage[x][y] = color.green;
-            blueImage[x][y] = color.blue;
+std::vector<ImagePlane> Deconvolver::splitChannels() const {
+    // A gray image is a single channel, deconvolved once rather than as three equal ones
+    return PlaneFile::matches(exactChannels, image) ? exactChannels : PlaneFile::fromBitmap(image);
+}
+
+void Deconvolver::mergeChannels(const std::vector<ImagePlane>& channels, double scalingFactor) {
+    // The scaled channels are kept in full precision, for a plane file or the next method, and the bitmap
+    // holds them truncated to 0..255
+    exactChannels = channels;
+    for (auto& channel : exactChannels) {
+        for (double& value : channel.data) {
+            value *= scalingFactor;
         }
     }
+    image = PlaneFile::toBitmap(exactChannels);
+}
 
-    // Perform the deconvolution for each color channel separately
-    std::vector<std::vector<double>> colorImages[3] = {redImage, greenImage, blueImage};
-    for (int color = 0; color < 3; color++) {
-        for (int iter = 0; iter < iterations; iter++) {
-            std::vector<std::vector<double>> ratio(image.width(), std::vector<double>(image.height()));
-            std::vector<std::vector<double>> convolvedImage = convolve(colorImages[color], kernel);
-
-            for (std::size_t x = 0; x < image.width(); x++) {
-                for (std::size_t y = 0; y < image.height(); y++) {
-                    ratio[x][y] = colorImages[color][x][y] / convolvedImage[x][y];
-                }
+std::vector<ImagePlane> Deconvolver::initialEstimate() const {
+    std::vector<ImagePlane> channels = splitChannels();
+    if (wienerStart) {
+        for (auto& channel : channels) {
+            channel = wienerEstimate(channel, *wienerStart, true);
+            // The multiplicative updates cannot recover from a negative pixel
+            for (double& value : channel.data) {
+                value = std::max(value, 0.0);
             }
+        }
+    }
+    return channels;
+}
 
-            std::vector<std::vector<double>> flippedKernel(kernel.rbegin(), kernel.rend());
-            for (auto& row : flippedKernel) {
-                std::reverse(row.begin(), row.end());
-            }
-            std::vector<std::vector<double>> convolvedRatio = convolve(ratio, flippedKernel);
+Deconvolver::FrequencyDomain Deconvolver::frequencyDomain(const ImagePlane& observed, bool foldedModel) const {
+    FrequencyDomain domain;
+    const int kw = kernel.size();
+    const int kh = kernel.empty() ? 0 : kernel[0].size();
+    Convolution::FFTPadding padding = Convolution::fftPadding(observed.width, observed.height, std::max(kw, 1),
+                                                              std::max(kh, 1));
+    domain.paddedWidth = padding.paddedWidth;
+    domain.paddedHeight = padding.paddedHeight;
+    // Center the image in the padded plane so the boundary fill is shared by both sides of the wrap
+    domain.left = (domain.paddedWidth - observed.width) / 2;
+    domain.top = (domain.paddedHeight - observed.height) / 2;
+    Convolution::pad(observed, domain.observed, domain.left, domain.top,
+                     domain.paddedWidth - observed.width - domain.left,
+                     domain.paddedHeight - observed.height - domain.top, boundary);
+
+    // The blur as ImageBlurrer applies it, correlation with the kernel anchored at its centre, rather than
+    // the folded operator convolve() has always used: the frequency-domain solvers are only as good as
+    // their model. A start for the RL methods inverts their own blur instead, the folded kernel anchored at
+    // its last entry as blurOperator builds it, so it is not shifted from the fit the iterations make. An
+    // empty kernel blurs everything away.
+    std::vector<std::vector<double>> model = kw > 0 && kh > 0 ? kernel : std::vector<std::vector<double>>{{0.0}};
+    int anchorX = model.size() / 2;
+    int anchorY = model[0].size() / 2;
+    if (foldedModel && kw > 0 && kh > 0) {
+        model = foldKernel(kernel);
+        anchorX = model.size() - 1;
+        anchorY = model[0].size() - 1;
+    }
+    domain.psf = PsfSpectrumCache::spectrum(model, anchorX, anchorY, domain.paddedWidth, domain.paddedHeight);
+    domain.laplacian = PsfSpectrumCache::laplacianSpectrum(domain.paddedWidth, domain.paddedHeight);
+    return domain;
+}
 
-            for (std::size_t x = 0; x < image.width(); x++) {
-                for (std::size_t y = 0; y < image.height(); y++) {
-                    colorImages[color][x][y] *= convolvedRatio[x][y];
-                }
-            }
-        }
+ImagePlane Deconvolver::FrequencyDomain::crop(const ImagePlane& padded, int width, int height) const {
+    ImagePlane cropped(width, height);
+    for (int y = 0; y < height; y++) {
+        std::copy_n(padded.row(y + top) + left, width, cropped.row(y));
     }
+    return cropped;
+}
 
-    // Assign the results back to each color channel
-    redImage = colorImages[0];
-    greenImage = colorImages[1];
-    blueImage = colorImages[2];
+ImagePlane Deconvolver::wienerEstimate(const ImagePlane& observed, double lambda, bool foldedModel) const {
+    if (observed.size() == 0) {
+        return observed;
+    }
+    FrequencyDomain domain = frequencyDomain(observed, foldedModel);
+    std::vector<std::complex<double>> spectrum(domain.observed.data.begin(), domain.observed.data.end());
+    FFT::transform2D(spectrum, domain.paddedWidth, domain.paddedHeight, false);
+    for (std::size_t k = 0; k < spectrum.size(); k++) {
+        const std::complex<double> h = (*domain.psf)[k];
+        const std::complex<double> y = spectrum[k];
+        const double denominator = std::norm(h) + lambda * std::norm((*domain.laplacian)[k]);
+        // Frequencies the kernel removes and the regularizer does not weigh are left at zero
+        spectrum[k] = denominator > 0.0 ? std::complex<double>(h.real() * y.real() + h.imag() * y.imag(),
+                                                               h.real() * y.imag() - h.imag() * y.real()) / denominator
+                                        : std::complex<double>();
+    }
+    FFT::transform2D(spectrum, domain.paddedWidth, domain.paddedHeight, true);
 
-    // Convert the color images back to an RGB image
-    for (std::size_t x = 0; x < image.width(); x++) {
-        for (std::size_t y = 0; y < image.height(); y++) {
-            rgb_t color;
-            color.red = std::min(255.0, std::max(0.0, redImage[x][y]));
-            color.green = std::min(255.0, std::max(0.0, greenImage[x][y]));
-            color.blue = std::min(255.0, std::max(0.0, blueImage[x][y]));
-            image.set_pixel(x, y, color);
+    for (std::size_t p = 0; p < spectrum.size(); p++) {
+        domain.observed.data[p] = spectrum[p].real();
+    }
+    return domain.crop(domain.observed, observed.width, observed.height);
+}
+
+void Deconvolver::deconvolveWiener(double lambda) {
+    std::vector<ImagePlane> colorImages = splitChannels();
+    for (auto& colorImage : colorImages) {
+        colorImage = wienerEstimate(colorImage, lambda);
+    }
+    mergeChannels(colorImages, 1.0);
+}
+
+ImagePlane& Deconvolver::Workspace::plane(std::size_t index, int width, int height) {
+    if (planes.size() <= index) {
+        planes.resize(index + 1);
+    }
+    planes[index].resize(width, height);
+    return planes[index];
+}
+
+std::vector<std::complex<double>>& Deconvolver::Workspace::spectrum(std::size_t index, std::size_t size) {
+    if (spectra.size() <= index) {
+        spectra.resize(index + 1);
+    }
+    spectra[index].resize(size);
+    return spectra[index];
+}
+
+Deconvolver::Convergence Deconvolver::primalDualTV(ImagePlane& channel, int maxIterations, double lambda,
+                                                   double tolerance) {
+    Convergence convergence;
+    if (channel.size() == 0) {
+        return convergence;
+    }
+    FrequencyDomain domain = frequencyDomain(channel);
+    const int paddedWidth = domain.paddedWidth;
+    const int paddedHeight = domain.paddedHeight;
+    const std::size_t size = domain.observed.size();
+
+    // Step sizes with tau * sigma * |grad|^2 <= 1, |grad|^2 <= 8 for the forward differences. A large tau
+    // lets the exact data step do most of the work.
+    const double tau = 1.0;
+    const double sigma = 1.0 / (8.0 * tau);
+
+    // The data step is x = (conj(H) Y + V / tau) / (|H|^2 + 1 / tau): precompute the fixed part and the
+    // weight of V
+    std::vector<std::complex<double>>& work = workspace.spectrum(0, size);
+    std::vector<std::complex<double>>& fixedPart = workspace.spectrum(1, size);
+    ImagePlane& weight = workspace.plane(4, paddedWidth, paddedHeight);
+    std::copy(domain.observed.data.begin(), domain.observed.data.end(), work.begin());
+    FFT::transform2D(work, paddedWidth, paddedHeight, false);
+    for (std::size_t k = 0; k < size; k++) {
+        const std::complex<double> h = (*domain.psf)[k];
+        const std::complex<double> y = work[k];
+        const double inverse = 1.0 / (std::norm(h) + 1.0 / tau);
+        fixedPart[k] = std::complex<double>(h.real() * y.real() + h.imag() * y.imag(),
+                                            h.real() * y.imag() - h.imag() * y.real()) * inverse;
+        weight.data[k] = inverse / tau;
+    }
+
+    ImagePlane& estimate = workspace.plane(0, paddedWidth, paddedHeight);
+    ImagePlane& extrapolated = workspace.plane(1, paddedWidth, paddedHeight);
+    ImagePlane& dualX = workspace.plane(2, paddedWidth, paddedHeight);
+    ImagePlane& dualY = workspace.plane(3, paddedWidth, paddedHeight);
+    estimate.data = domain.observed.data;
+    extrapolated.data = domain.observed.data;
+    std::fill(dualX.data.begin(), dualX.data.end(), 0.0);
+    std::fill(dualY.data.begin(), dualY.data.end(), 0.0);
+    for (int iter = 0; iter < maxIterations; iter++) {
+        DeconvolutionUtils::applyDualTVStep(extrapolated, dualX, dualY, sigma, lambda);
+        DeconvolutionUtils::applyDivergenceStep(estimate, dualX, dualY, tau, work);
+        FFT::transform2D(work, paddedWidth, paddedHeight, false);
+        for (std::size_t k = 0; k < size; k++) {
+            work[k] = fixedPart[k] + weight.data[k] * work[k];
+        }
+        FFT::transform2D(work, paddedWidth, paddedHeight, true);
+
+        // New estimate, over-relaxed copy for the next dual step, and the size of the change, in one pass
+        double change = 0.0;
+        double norm = 0.0;
+        for (std::size_t p = 0; p < size; p++) {
+            double next = work[p].real();
+            double difference = next - estimate.data[p];
+            extrapolated.data[p] = next + difference;
+            estimate.data[p] = next;
+            change += difference * difference;
+            norm += next * next;
+        }
+        convergence.iterations++;
+        convergence.history.push_back(norm > 0.0 ? std::sqrt(change / norm) : 0.0);
+        if (convergence.history.back() < tolerance) {
+            break;
         }
     }
+
+    channel = domain.crop(estimate, channel.width, channel.height);
+    return convergence;
 }
 
-void Deconvolver::deconvolveAuto(int iterations, double lambda) {
-    std::vector<std::vector<double>> redImage(image.width(), std::vector<double>(image.height()));
-    std::vector<std::vector<double>> greenImage(image.width(), std::vector<double>(image.height()));
-    std::vector<std::vector<double>> blueImage(image.width(), std::vector<double>(image.height()));
-
-    for (std::size_t x = 0; x < image.width(); x++) {
-        for (std::size_t y = 0; y < image.height(); y++) {
-            rgb_t color = image.get_pixel(x, y);
-            redImage[x][y] = color.red;
-            greenImage[x][y] = color.green;
-            blueImage[x][y] = color.blue;
+Deconvolver::Convergence Deconvolver::admm(ImagePlane& channel, int maxIterations, double lambda, double mu,
+                                           double tolerance) {
+    Convergence convergence;
+    if (channel.size() == 0) {
+        return convergence;
+    }
+    FrequencyDomain domain = frequencyDomain(channel);
+    const int paddedWidth = domain.paddedWidth;
+    const int paddedHeight = domain.paddedHeight;
+    const std::size_t size = domain.observed.size();
+
+    // Penalty of the splits, in the same gray-level units as lambda
+    const double rho = admmPenalty;
+
+    // The x update solves (H^T H + mu L^T L + rho (grad^T grad + 1)) x = H^T y + rho (grad^T a + b) for the
+    // targets a and b. grad^T grad of the wrapping differences is the 5-point Laplacian, so everything is
+    // diagonal in the frequency domain; precompute H^T y / denominator and rho / denominator.
+    std::vector<std::complex<double>>& work = workspace.spectrum(0, size);
+    std::vector<std::complex<double>>& fixedPart = workspace.spectrum(1, size);
+    ImagePlane& weight = workspace.plane(7, paddedWidth, paddedHeight);
+    std::copy(domain.observed.data.begin(), domain.observed.data.end(), work.begin());
+    FFT::transform2D(work, paddedWidth, paddedHeight, false);
+    for (std::size_t k = 0; k < size; k++) {
+        const std::complex<double> h = (*domain.psf)[k];
+        const std::complex<double> l = (*domain.laplacian)[k];
+        const std::complex<double> y = work[k];
+        const double inverse = 1.0 / (std::norm(h) + mu * std::norm(l) + rho * (l.real() + 1.0));
+        fixedPart[k] = std::complex<double>(h.real() * y.real() + h.imag() * y.imag(),
+                                            h.real() * y.imag() - h.imag() * y.real()) * inverse;
+        weight.data[k] = rho * inverse;
+    }
+
+    ImagePlane& estimate = workspace.plane(0, paddedWidth, paddedHeight);
+    ImagePlane& targetX = workspace.plane(1, paddedWidth, paddedHeight);
+    ImagePlane& targetY = workspace.plane(2, paddedWidth, paddedHeight);
+    ImagePlane& targetPositive = workspace.plane(3, paddedWidth, paddedHeight);
+    ImagePlane& dualX = workspace.plane(4, paddedWidth, paddedHeight);
+    ImagePlane& dualY = workspace.plane(5, paddedWidth, paddedHeight);
+    ImagePlane& dualPositive = workspace.plane(6, paddedWidth, paddedHeight);
+    estimate.data = domain.observed.data;
+    for (ImagePlane* dual : {&dualX, &dualY, &dualPositive}) {
+        std::fill(dual->data.begin(), dual->data.end(), 0.0);
+    }
+    DeconvolutionUtils::applyADMMSplitStep(estimate, dualX, dualY, dualPositive, targetX, targetY, targetPositive,
+                                           lambda / rho);
+    for (int iter = 0; iter < maxIterations; iter++) {
+        // grad^T a + b = b - div(a)
+        DeconvolutionUtils::applyDivergenceStep(targetPositive, targetX, targetY, -1.0, work);
+        FFT::transform2D(work, paddedWidth, paddedHeight, false);
+        for (std::size_t k = 0; k < size; k++) {
+            work[k] = fixedPart[k] + weight.data[k] * work[k];
+        }
+        FFT::transform2D(work, paddedWidth, paddedHeight, true);
+
+        double change = 0.0;
+        double norm = 0.0;
+        for (std::size_t p = 0; p < size; p++) {
+            double next = work[p].real();
+            double difference = next - estimate.data[p];
+            estimate.data[p] = next;
+            change += difference * difference;
+            norm += next * next;
+        }
+        DeconvolutionUtils::applyADMMSplitStep(estimate, dualX, dualY, dualPositive, targetX, targetY,
+                                               targetPositive, lambda / rho);
+        convergence.iterations++;
+        convergence.history.push_back(norm > 0.0 ? std::sqrt(change / norm) : 0.0);
+        if (convergence.history.back() < tolerance) {
+            break;
         }
     }
 
-    // Perform the deconvolution for each color channel separately
-    std::vector<std::vector<double>> colorImages[3] = {redImage, greenImage, blueImage};
-    for (int color = 0; color < 3; color++) {
-        for (int iter = 0; iter < iterations; iter++) {
-            std::vector<std::vector<double>> ratio(image.width(), std::vector<double>(image.height()));
-            std::vector<std::vector<double>> convolvedImage = convolve(colorImages[color], kernel);
+    channel = domain.crop(estimate, channel.width, channel.height);
+    return convergence;
+}
 
-            // Laplacian filter for calculating image roughness
-            std::vector<std::vector<double>> laplacianFilter = {{0, -1, 0}, {-1, 4, -1}, {0, -1, 0}};
-            std::vector<std::vector<double>> laplacianImage = convolve(colorImages[color], laplacianFilter);
+std::vector<Deconvolver::Convergence> Deconvolver::deconvolvePrimalDual(int maxIterations, double lambda,
+                                                                        double tolerance) {
+    std::vector<ImagePlane> colorImages = splitChannels();
+    std::vector<Convergence> convergence;
+    for (auto& colorImage : colorImages) {
+        convergence.push_back(primalDualTV(colorImage, maxIterations, lambda, tolerance));
+    }
+    mergeChannels(colorImages, 1.0);
+    return convergence;
+}
 
-            for (std::size_t x = 0; x < image.width(); x++) {
-                for (std::size_t y = 0; y < image.height(); y++) {
-                    ratio[x][y] = colorImages[color][x][y] / (convolvedImage[x][y] + lambda * laplacianImage[x][y]);
-                }
-            }
+std::vector<Deconvolver::Convergence> Deconvolver::deconvolveADMM(int maxIterations, double lambda, double mu,
+                                                                  double tolerance) {
+    std::vector<ImagePlane> colorImages = splitChannels();
+    std::vector<Convergence> convergence;
+    for (auto& colorImage : colorImages) {
+        convergence.push_back(admm(colorImage, maxIterations, lambda, mu, tolerance));
+    }
+    mergeChannels(colorImages, 1.0);
+    return convergence;
+}
 
-            std::vector<std::vector<double>> flippedKernel(kernel.rbegin(), kernel.rend());
-            for (auto& row : flippedKernel) {
-                std::reverse(row.begin(), row.end());
-            }
-            std::vector<std::vector<double>> convolvedRatio = convolve(ratio, flippedKernel);
+std::vector<std::vector<double>> Deconvolver::flipKernel(const std::vector<std::vector<double>>& kernel) {
+    std::vector<std::vector<double>> flippedKernel(kernel.rbegin(), kernel.rend());
+    for (auto& row : flippedKernel) {
+        std::reverse(row.begin(), row.end());
+    }
+    return flippedKernel;
+}
 
-            for (std::size_t x = 0; x < image.width(); x++) {
-                for (std::size_t y = 0; y < image.height(); y++) {
-                    colorImages[color][x][y] *= convolvedRatio[x][y];
+Deconvolver::TimedRun Deconvolver::richardsonLucy(int iterations, Regularization regularization, double lambda,
+                                                  double alpha, double scalingFactor,
+                                                  std::optional<std::chrono::steady_clock::time_point> deadline) {
+    Checkpoint state;
+    state.channels = initialEstimate();
+    if (state.channels.empty()) {
+        return TimedRun();
+    }
+    std::unique_ptr<ConvolutionOperator> blur =
+        blurOperator(state.channels[0].width, state.channels[0].height, backend, backend, boundary);
+    state.method = static_cast<std::int32_t>(regularization);
+    state.iterations = iterations;
+    state.boundary = static_cast<std::int32_t>(boundary);
+    state.forwardAlgorithm = static_cast<std::int32_t>(blur->forwardAlgorithm());
+    state.adjointAlgorithm = static_cast<std::int32_t>(blur->adjointAlgorithm());
+    state.lambda = lambda;
+    state.alpha = alpha;
+    state.scalingFactor = scalingFactor;
+    state.kernel = kernel;
+    return richardsonLucy(state, *blur, deadline);
+}
+
+Deconvolver::TimedRun Deconvolver::richardsonLucy(Checkpoint& state, LinearOperator& blur,
+                                                  std::optional<std::chrono::steady_clock::time_point> deadline) {
+    TimedRun run;
+    checkpointFailed = false;
+    std::vector<ImagePlane>& colorImages = state.channels;
+    const auto regularization = static_cast<Regularization>(state.method);
+    const double lambda = state.lambda;
+    const double alpha = state.alpha;
+    ImagePlane& correction = workspace.plane(0, colorImages[0].width, colorImages[0].height);
+    ImagePlane& offset = workspace.plane(1, colorImages[0].width, colorImages[0].height);
+
+    // Each iteration goes over every channel, so a run cut short by the deadline leaves them all at the same
+    // iteration; the channels are independent and the result does not depend on the order
+    while (state.iteration < state.iterations) {
+        auto start = std::chrono::steady_clock::now();
+        if (deadline && start + std::chrono::duration<double, std::milli>(run.iterationMilliseconds) > *deadline) {
+            break;
+        }
+        for (auto& colorImage : colorImages) {
+            if (regularization == Regularization::TIKHONOV) {
+                // Laplacian of the estimate for calculating image roughness, with the stencil unrolled at
+                // compile time; it joins the blurred estimate in the denominator of the ratio
+                Convolution::correlateStencil<3, laplacianTaps>(colorImage, offset);
+                for (double& value : offset.data) {
+                    value *= lambda;
                 }
             }
+            if (regularization == Regularization::TV) {
+                // TV regularization and the multiplicative update in one sweep; the result becomes the estimate
+                blur.correction(colorImage, colorImage, correction);
+                DeconvolutionUtils::applyTVUpdate(colorImage, correction, lambda, alpha);
+            } else {
+                // Ratio, correlation and multiplicative update fused band by band by the operator
+                blur.update(colorImage, colorImage, correction,
+                            regularization == Regularization::TIKHONOV ? &offset : nullptr);
+            }
+            std::swap(colorImage, correction);
+        }
+        state.iteration++;
+        run.iterations++;
+        run.iterationMilliseconds =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        // The snapshot is copied here and written by another thread. If the previous one is still being
+        // written, this one is skipped rather than waited for. Runs against a deadline are not checkpointed.
+        if (!deadline && checkpointInterval > 0 && state.iteration % checkpointInterval == 0 &&
+            state.iteration < state.iterations &&
+            (!pendingCheckpoint.valid() ||
+             pendingCheckpoint.wait_for(std::chrono::seconds(0)) == std::future_status::ready)) {
+            if (pendingCheckpoint.valid()) {
+                checkpointFailed = !pendingCheckpoint.get();
+            }
+            pendingCheckpoint = std::async(std::launch::async, [snapshot = state, path = checkpointPath] {
+                return snapshot.save(path);
+            });
         }
     }
-// Assign the results back to each color channel
-    redImage = colorImages[0];
-    greenImage = colorImages[1];
-    blueImage = colorImages[2];
+    if (pendingCheckpoint.valid()) {
+        checkpointFailed = !pendingCheckpoint.get();
+    }
 
     // Convert the color images back to an RGB image
-    for (std::size_t x = 0; x < image.width(); x++) {
-        for (std::size_t y = 0; y < image.height(); y++) {
-            rgb_t color;
-            color.red = std::min(255.0, std::max(0.0, redImage[x][y]));
-            color.green = std::min(255.0, std::max(0.0, greenImage[x][y]));
-            color.blue = std::min(255.0, std::max(0.0, blueImage[x][y]));
-            image.set_pixel(x, y, color);
-        }
-    }
+    mergeChannels(colorImages, state.scalingFactor);
+    return run;
 }
 
-void Deconvolver::deconvolveTV(int iterations, double lambda, double alpha, double scalingFactor) {
-    std::vector<std::vector<double>> redImage(image.width(), std::vector<double>(image.height()));
-    std::vector<std::vector<double>> greenImage(image.width(), std::vector<double>(image.height()));
-    std::vector<std::vector<double>> blueImage(image.width(), std::vector<double>(image.height()));
-
-    for (std::size_t x = 0; x < image.width(); x++) {
-        for (std::size_t y = 0; y < image.height(); y++) {
-            rgb_t color = image.get_pixel(x, y);
-            redImage[x][y] = color.red;
-            greenImage[x][y] = color.green;
-            blueImage[x][y] = color.blue;
-        }
+bool Deconvolver::resume(const std::string& path) {
+    Checkpoint state;
+    auto inRange = [](std::int32_t value, auto last) { return value >= 0 && value <= static_cast<std::int32_t>(last); };
+    if (!state.load(path) || state.kernel != kernel || state.channels.empty() ||
+        state.channels.size() != splitChannels().size() ||
+        state.channels[0].width != static_cast<int>(image.width()) ||
+        state.channels[0].height != static_cast<int>(image.height()) || !inRange(state.method, Regularization::TV) ||
+        !inRange(state.boundary, Convolution::Boundary::TAPER) ||
+        !inRange(state.forwardAlgorithm, Convolution::Algorithm::FFT) ||
+        !inRange(state.adjointAlgorithm, Convolution::Algorithm::FFT)) {
+        return false;
     }
+    // The run continues with the boundary and the backends it started with, whatever the planner would pick now
+    std::unique_ptr<ConvolutionOperator> blur =
+        blurOperator(image.width(), image.height(), static_cast<Convolution::Algorithm>(state.forwardAlgorithm),
+                     static_cast<Convolution::Algorithm>(state.adjointAlgorithm),
+                     static_cast<Convolution::Boundary>(state.boundary));
+    richardsonLucy(state, *blur, std::nullopt);
+    return true;
+}
 
-    // Perform the deconvolution for each color channel separately
-    std::vector<std::vector<double>> colorImages[3] = {redImage, greenImage, blueImage};
-    for (int color = 0; color < 3; color++) {
-        for (int iter = 0; iter < iterations; iter++) {
-            std::vector<std::vector<double>> ratio(image.width(), std::vector<double>(image.height()));
-            std::vector<std::vector<double>> convolvedImage = convolve(colorImages[color], kernel);
+void Deconvolver::deconvolve(int iterations) {
+    richardsonLucy(iterations, Regularization::NONE, 0.0, 0.0, 1.0);
+}
 
-            for (std::size_t x = 0; x < image.width(); x++) {
-                for (std::size_t y = 0; y < image.height(); y++) {
-                    ratio[x][y] = colorImages[color][x][y] / convolvedImage[x][y];
-                }
-            }
+void Deconvolver::deconvolveAuto(int iterations, double lambda) {
+    richardsonLucy(iterations, Regularization::TIKHONOV, lambda, 0.0, 1.0);
+}
 
-            std::vector<std::vector<double>> flippedKernel(kernel.rbegin(), kernel.rend());
-            for (auto& row : flippedKernel) {
-                std::reverse(row.begin(), row.end());
-            }
-            std::vector<std::vector<double>> convolvedRatio = convolve(ratio, flippedKernel);
-
-            // TV Regularization
-            std::vector<std::vector<double>> difference(image.width(), std::vector<double>(image.height()));
-            for (std::size_t x = 0; x < image.width(); x++) {
-                for (std::size_t y = 0; y < image.height(); y++) {
-                    double diff = colorImages[color][x][y] - convolvedRatio[x][y];
-                    difference[x][y] = diff;
-                }
-            }
+void Deconvolver::deconvolveTV(int iterations, double lambda, double alpha, double scalingFactor) {
+    richardsonLucy(iterations, Regularization::TV, lambda, alpha, scalingFactor);
+}
+
+Deconvolver::TimedRun Deconvolver::deconvolveWithin(std::chrono::milliseconds budget, int maxIterations) {
+    auto start = std::chrono::steady_clock::now();
+    TimedRun run;
+    if (budget.count() > 0) {
+        run = richardsonLucy(maxIterations, Regularization::NONE, 0.0, 0.0, 1.0, start + budget);
+    }
+    run.elapsedMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return run;
+}
 
-            std::vector<std::vector<double>> gradientX = DeconvolutionUtils::computeGradientX(colorImages[color]);
-            std::vector<std::vector<double>> gradientY = DeconvolutionUtils::computeGradientY(colorImages[color]);
+std::vector<Deconvolver::ActiveSet> Deconvolver::deconvolveActiveSet(int iterations, double threshold, int tileSize) {
+    std::vector<ImagePlane> colorImages = initialEstimate();
+    std::vector<ActiveSet> reports;
+    if (colorImages.empty()) {
+        return reports;
+    }
+    const int width = colorImages[0].width;
+    const int height = colorImages[0].height;
+    tileSize = std::max(tileSize, 1);
+    const int tilesX = (width + tileSize - 1) / tileSize;
+    const int tilesY = (height + tileSize - 1) / tileSize;
+    std::unique_ptr<LinearOperator> blur = blurOperator(width, height, backend, backend, boundary);
+
+    // One iteration reads this far around each pixel: a span of tiles is updated from a crop extended by it,
+    // and a tile stays active while a tile this close to it still moves
+    const int halo = static_cast<int>(regionHalo(1));
+    const int haloTiles = (halo + tileSize - 1) / tileSize;
+
+    for (auto& colorImage : colorImages) {
+        ActiveSet report;
+        std::vector<char> active(static_cast<std::size_t>(tilesX) * tilesY, 1);
+        std::vector<double> change(active.size());
+        ImagePlane& next = workspace.plane(0, width, height);
+        ImagePlane& crop = workspace.plane(1, 0, 0);
+        ImagePlane& updated = workspace.plane(2, 0, 0);
 
-            for (std::size_t x = 0; x < image.width(); x++) {
-                for (std::size_t y = 0; y < image.height(); y++) {
-                    double gx = gradientX[x][y];
-                    double gy = gradientY[x][y];
-                    double tvWeight = alpha / (std::sqrt(gx * gx + gy * gy) + lambda);
-                    convolvedRatio[x][y] += tvWeight * difference[x][y];
+        for (int iter = 0; iter < iterations; iter++) {
+            // Frozen tiles keep their values; the active ones are all updated from the current estimate
+            std::copy(colorImage.data.begin(), colorImage.data.end(), next.data.begin());
+            std::fill(change.begin(), change.end(), 0.0);
+            std::size_t activePixels = 0;
+
+            for (int ty = 0; ty < tilesY; ty++) {
+                for (int tx = 0; tx < tilesX;) {
+                    if (!active[ty * tilesX + tx]) {
+                        tx++;
+                        continue;
+                    }
+                    // Run of active tiles along the tile row, updated through a single crop
+                    int spanEnd = tx;
+                    while (spanEnd < tilesX && active[ty * tilesX + spanEnd]) {
+                        spanEnd++;
+                    }
+                    const int x0 = tx * tileSize;
+                    const int x1 = std::min(width, spanEnd * tileSize);
+                    const int y0 = ty * tileSize;
+                    const int y1 = std::min(height, y0 + tileSize);
+                    const int cropX = std::max(0, x0 - halo);
+                    const int cropY = std::max(0, y0 - halo);
+                    crop.resize(std::min(width, x1 + halo) - cropX, std::min(height, y1 + halo) - cropY);
+                    for (int y = 0; y < crop.height; y++) {
+                        std::copy_n(colorImage.row(cropY + y) + cropX, crop.width, crop.row(y));
+                    }
+                    blur->update(crop, crop, updated);
+
+                    for (int y = y0; y < y1; y++) {
+                        const double* updatedRow = updated.row(y - cropY) - cropX;
+                        const double* currentRow = colorImage.row(y);
+                        double* nextRow = next.row(y);
+                        for (int x = x0; x < x1; x++) {
+                            nextRow[x] = updatedRow[x];
+                            // Written so that a NaN change keeps the tile active
+                            double difference = std::abs(updatedRow[x] - currentRow[x]);
+                            double& tileChange = change[ty * tilesX + x / tileSize];
+                            if (!(difference <= tileChange)) {
+                                tileChange = difference;
+                            }
+                        }
+                    }
+                    activePixels += static_cast<std::size_t>(x1 - x0) * (y1 - y0);
+                    tx = spanEnd;
                 }
             }
-
-            for (std::size_t x = 0; x < image.width(); x++) {
-                for (std::size_t y = 0; y < image.height(); y++) {
-                    colorImages[color][x][y] *= convolvedRatio[x][y];
+            std::swap(colorImage, next);
+            report.activeFraction.push_back(static_cast<double>(activePixels) / (static_cast<double>(width) * height));
+
+            // Tiles within the halo of a tile that moved by threshold or more see new inputs and are updated
+            // next time, frozen ones included; the others would repeat their last, smaller, change and are frozen
+            std::vector<char> stillActive(active.size(), 0);
+            for (int ty = 0; ty < tilesY; ty++) {
+                for (int tx = 0; tx < tilesX; tx++) {
+                    if (!active[ty * tilesX + tx] || change[ty * tilesX + tx] < threshold) {
+                        continue;
+                    }
+                    for (int ny = std::max(0, ty - haloTiles); ny <= std::min(tilesY - 1, ty + haloTiles); ny++) {
+                        for (int nx = std::max(0, tx - haloTiles); nx <= std::min(tilesX - 1, tx + haloTiles); nx++) {
+                            stillActive[ny * tilesX + nx] = 1;
+                        }
+                    }
                 }
             }
+            active.swap(stillActive);
         }
+        reports.push_back(std::move(report));
     }
 
-    // Assign the results back to each color channel
-    redImage = colorImages[0];
-    greenImage = colorImages[1];
-    blueImage = colorImages[2];
+    mergeChannels(colorImages, 1.0);
+    return reports;
+}
 
+unsigned int Deconvolver::regionHalo(int iterations) const {
+    // The folded kernel reads (size - 1) / 2 pixels up and to the left along each axis and nothing beyond,
+    // and an iteration applies it twice, for the blur and its adjoint. The Laplacian of deconvolveAuto reads
+    // one pixel back and the TV weighting one pixel either way, which stays within that reach unless the
+    // kernel is a single pixel.
+    std::size_t kernelRadius = 0;
+    for (const auto& row : kernel) {
+        kernelRadius = std::max(kernelRadius, row.empty() ? 0 : (row.size() - 1) / 2);
+    }
+    kernelRadius = std::max(kernelRadius, kernel.empty() ? 0 : (kernel.size() - 1) / 2);
+    return static_cast<unsigned int>(std::max(iterations, 0) * std::max<std::size_t>(2 * kernelRadius, 1));
+}
 
-    // Convert the color images back to an RGB image
-    for (std::size_t x = 0; x < image.width(); x++) {
-        for (std::size_t y = 0; y < image.height(); y++) {
-            rgb_t color;
-            color.red = static_cast<unsigned char>(std::min(255.0, std::max(0.0, redImage[x][y] * scalingFactor)));
-            color.green = static_cast<unsigned char>(std::min(255.0, std::max(0.0, greenImage[x][y] * scalingFactor)));
-            color.blue = static_cast<unsigned char>(std::min(255.0, std::max(0.0, blueImage[x][y] * scalingFactor)));
-            image.set_pixel(x, y, color);
+bitmap_image Deconvolver::deconvolveRegion(unsigned int x, unsigned int y, unsigned int width, unsigned int height,
+                                           int iterations, const std::function<void(Deconvolver&)>& method) {
+    // Clip the requested rectangle to the image
+    x = std::min(x, image.width());
+    y = std::min(y, image.height());
+    width = std::min(width, image.width() - x);
+    height = std::min(height, image.height() - y);
+    if (width == 0 || height == 0) {
+        return bitmap_image();
+    }
+
+    // Extend the region by the halo, clipped to the image borders
+    unsigned int halo = regionHalo(iterations);
+    unsigned int haloX = x - std::min(x, halo);
+    unsigned int haloY = y - std::min(y, halo);
+    unsigned int haloWidth = std::min(x + width + halo, image.width()) - haloX;
+    unsigned int haloHeight = std::min(y + height + halo, image.height()) - haloY;
+
+    bitmap_image haloRegion;
+    image.region(haloX, haloY, haloWidth, haloHeight, haloRegion);
+
+    Deconvolver regionDeconvolver(kernel, haloRegion);
+    if (PlaneFile::matches(exactChannels, image)) {
+        regionDeconvolver.exactChannels.assign(exactChannels.size(), ImagePlane(haloWidth, haloHeight));
+        for (std::size_t c = 0; c < exactChannels.size(); c++) {
+            for (unsigned int row = 0; row < haloHeight; row++) {
+                std::copy_n(exactChannels[c].row(haloY + row) + haloX, haloWidth,
+                            regionDeconvolver.exactChannels[c].row(row));
+            }
         }
     }
+    regionDeconvolver.setBoundary(boundary);
+    regionDeconvolver.setBackend(backend);
+    regionDeconvolver.wienerStart = wienerStart;
+    method(regionDeconvolver);
+
+    bitmap_image crop;
+    regionDeconvolver.image.region(x - haloX, y - haloY, width, height, crop);
+    return crop;
+}
+
+bitmap_image Deconvolver::deconvolveRegion(unsigned int x, unsigned int y, unsigned int width, unsigned int height,
+                                           int iterations) {
+    return deconvolveRegion(x, y, width, height, iterations,
+                            [iterations](Deconvolver& deconvolver) { deconvolver.deconvolve(iterations); });
 }
 
 
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "ImagePlane.hh"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Snapshot of a Richardson-Lucy run, enough to continue it bit for bit: the estimate of every channel in
+// full precision, the iteration reached, and the parameters and resolved backends of the run. Stored as a
+// compact binary file in native byte order.
+struct Checkpoint {
+    std::int32_t method = 0;
+    std::int32_t iteration = 0;
+    std::int32_t iterations = 0;
+    std::int32_t boundary = 0;
+    std::int32_t forwardAlgorithm = 0;
+    std::int32_t adjointAlgorithm = 0;
+    double lambda = 0.0;
+    double alpha = 0.0;
+    double scalingFactor = 1.0;
+    std::vector<std::vector<double>> kernel;
+    std::vector<ImagePlane> channels;
+
+    // Written under a temporary name and renamed, so a crash during the write leaves the previous checkpoint
+    // in place; false if the file could not be written
+    bool save(const std::string& path) const;
+
+    // false if the file is missing, truncated, not a checkpoint, or its header does not match its length
+    bool load(const std::string& path);
+};
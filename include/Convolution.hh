@@ -0,0 +1,213 @@
+#pragma once
+
+#include "ImagePlane.hh"
+#include "IntegralImage.hh"
+#include "ParallelUtils.hh"
+#include <algorithm>
+#include <array>
+#include <utility>
+#include <vector>
+
+// Convolution engine shared by the blur and deconvolution code. All algorithms compute the same
+// correlation with zeros outside the image; they only differ in cost.
+class Convolution {
+public:
+    // WINOGRAD applies to 3x3 kernels with a centred anchor only; other kernels fall back to DIRECT. AUTO
+    // never picks it, nor does ConvolutionPlanner measure it: on one channel of doubles the extra transform
+    // additions cost more than the multiplies it saves, and the unrolled 3x3 loop measured 2.2 to 2.4 times
+    // as fast from 512x512 to 2048x2048. It only runs when a caller asks for it (Deconvolver::setBackend);
+    // checks/winograd_check.cc compares it with DIRECT.
+    // BLOCKED is the direct sum computed over register tiles, for mid-size dense kernels.
+    enum class Algorithm { AUTO, DIRECT, SEPARABLE, SPARSE, WINOGRAD, BLOCKED, FFT };
+
+    // What the kernel reads outside the image: zeros, the image mirrored about its edge pixels
+    // (in(-1) = in(1)), the nearest edge pixel, or the mirrored image faded to zero by a raised cosine
+    // over the width of the kernel, which keeps the edge step out of the deconvolution ratio
+    enum class Boundary { ZERO, MIRROR, REPLICATE, TAPER };
+
+    // Transform size of the FFT path for an image and kernel size: the linear convolution needs
+    // (width + kw - 1) x (height + kh - 1), rounded up to the cheapest 2.3.5.7-smooth lengths. relativeCost
+    // is the estimated transform time at the padded size over the time at the raw linear size, and
+    // powerOfTwoCost the same ratio for power of two padding.
+    struct FFTPadding {
+        int rawWidth = 0;
+        int rawHeight = 0;
+        int paddedWidth = 0;
+        int paddedHeight = 0;
+        double relativeCost = 1.0;
+        double powerOfTwoCost = 1.0;
+    };
+
+    // Kernel as a list of non-zero taps: out(x, y) = sum over taps of weight * in(x + dx, y + dy).
+    // Taps are applied in list order; the same offset may appear more than once.
+    struct SparseKernel {
+        struct Tap {
+            int dx;
+            int dy;
+            double weight;
+        };
+        std::vector<Tap> taps;
+
+        // Non-zero entries of a dense [x][y] kernel, in kernel order
+        static SparseKernel fromDense(const std::vector<std::vector<double>>& kernel, int anchorX, int anchorY);
+    };
+
+    // Fraction of non-zero entries below which a dense kernel is applied through its tap list
+    static constexpr double sparseDensity = 0.35;
+
+    // Square kernels with a centred anchor and one of these sizes run through a loop specialized at
+    // compile time for the size, with every tap unrolled and the sum kept in a register
+    static constexpr std::array<int, 4> fixedSizes = {3, 5, 7, 9};
+
+    // Dense kernels with at least this many entries and no fixed size use the register-blocked loop,
+    // which computes blockRows x blockColumns outputs at a time. The tile width may also be one of
+    // blockColumnChoices; every width sums each output in the same order, so the results are identical.
+    static constexpr int blockedMinTaps = 100;
+    static constexpr int blockRows = 4;
+    static constexpr int blockColumns = 8;
+    static constexpr std::array<int, 3> blockColumnChoices = {4, 8, 16};
+
+    // Sizes the FFT and BLOCKED paths work at, as ConvolutionPlanner measured them; 0 (so Layout{}) keeps
+    // the default of each, the padding of fftPadding and blockColumns. A transform size too small for the
+    // linear convolution (for instance once a boundary mode has extended the image) is ignored, and so is a
+    // tile width that is not one of blockColumnChoices.
+    struct Layout {
+        int fftWidth;
+        int fftHeight;
+        int blockColumns;
+    };
+
+    // Kernel whose weights are known at compile time, indexed [x][y] with the anchor at the centre
+    template <int K>
+    using Stencil = std::array<std::array<double, K>, K>;
+
+    static constexpr Stencil<3> laplacian = {{{0, -1, 0}, {-1, 4, -1}, {0, -1, 0}}};
+
+    // Scratch planes of correlate(): the boundary extension and its result, the vertical pass of the
+    // separable path and the zero-margined copy of the blocked path. A caller correlating the same sizes
+    // repeatedly keeps one, so the planes are allocated by the first call only. One workspace serves one
+    // call at a time.
+    struct Workspace {
+        ImagePlane extended;
+        ImagePlane extendedOut;
+        ImagePlane vertical;
+        ImagePlane padded;
+    };
+
+    // correlate() for a compile-time stencil: the zero taps are dropped by the compiler
+    template <int K, Stencil<K> weights>
+    static void correlateStencil(const ImagePlane& in, ImagePlane& out);
+
+    // out(x, y) = sum over i, j of kernel[i][j] * in(x + i - anchorX, y + j - anchorY), where the kernel is
+    // indexed [x][y] like the kernels of ImageBlurrer. out is resized to the size of in and may not alias it.
+    // A boundary other than ZERO pads the image by the kernel extent first and crops the result.
+    static void correlate(const ImagePlane& in, ImagePlane& out, const std::vector<std::vector<double>>& kernel,
+                          int anchorX, int anchorY, Algorithm algorithm = Algorithm::AUTO,
+                          Boundary boundary = Boundary::ZERO);
+
+    // The same with the scratch planes taken from workspace, and the sizes of layout
+    static void correlate(const ImagePlane& in, ImagePlane& out, const std::vector<std::vector<double>>& kernel,
+                          int anchorX, int anchorY, Workspace& workspace, Algorithm algorithm = Algorithm::AUTO,
+                          Boundary boundary = Boundary::ZERO, const Layout& layout = {});
+
+    static void correlate(const ImagePlane& in, ImagePlane& out, const SparseKernel& kernel);
+
+    // Gaussian blur by Young - van Vliet recursive filtering, a causal and an anti-causal third-order pass
+    // along each axis, with zeros outside the image. The interior costs the same per pixel for any sigma;
+    // each line is extended by a 3 * sigma zero tail so the anti-causal pass starts from the decayed causal
+    // response. Sigma is clamped to at least 0.5. Against the exact sampled Gaussian of the same sigma the
+    // largest error of the impulse response is under 2% of its peak for sigma >= 5 (4% below); on an 8-bit
+    // image it stays within 2.5 gray levels for sigma >= 2, the worst case being the corners of hard-edged
+    // squares (under 2 on photographs). checks/recursive_gaussian_check.cc measures both for sigma 20 to 50.
+    static void gaussianRecursive(const ImagePlane& in, ImagePlane& out, double sigma);
+
+    // Uniform size x size blur anchored at size / 2, with zeros outside the image, read from a summed-area
+    // table so the cost per pixel does not depend on size. Each extra pass blurs the previous result again,
+    // giving the correlation with the box convolved passes times with itself; three or more passes
+    // approximate a Gaussian of variance passes * (size * size - 1) / 12.
+    static void boxFilter(const ImagePlane& in, ImagePlane& out, int size, int passes = 1);
+
+    // Extend in by left, top, right and bottom pixels filled according to boundary
+    static void pad(const ImagePlane& in, ImagePlane& out, int left, int top, int right, int bottom, Boundary boundary);
+
+    static FFTPadding fftPadding(int width, int height, int kw, int kh);
+
+    // Cheapest algorithm for a width x height image, from operation counts per output pixel
+    static Algorithm chooseAlgorithm(int width, int height, const std::vector<std::vector<double>>& kernel);
+
+    // Cost model behind chooseAlgorithm: relative time per output pixel, infinite when the algorithm does
+    // not apply to the kernel
+    static double estimatedCost(Algorithm algorithm, int width, int height, const std::vector<std::vector<double>>& kernel);
+
+    // Square kernel of one of the fixedSizes
+    static bool isFixedSize(const std::vector<std::vector<double>>& kernel);
+
+    // Split a rank-one kernel as kernel[i][j] = weightsX[i] * weightsY[j]; false if it is not separable
+    static bool separate(const std::vector<std::vector<double>>& kernel, std::vector<double>& weightsX,
+                         std::vector<double>& weightsY);
+
+private:
+    static void correlateDirect(const ImagePlane& in, ImagePlane& out, const std::vector<std::vector<double>>& kernel,
+                                int anchorX, int anchorY);
+    static void correlateSeparable(const ImagePlane& in, ImagePlane& out, const std::vector<double>& weightsX,
+                                   const std::vector<double>& weightsY, int anchorX, int anchorY,
+                                   ImagePlane& vertical);
+    // Specialized loop for the fixed sizes; false if the kernel is not one of them
+    static bool correlateFixed(const ImagePlane& in, ImagePlane& out, const std::vector<std::vector<double>>& kernel,
+                               int anchorX, int anchorY);
+    template <int K>
+    static void correlateFixedSize(const ImagePlane& in, ImagePlane& out, const std::vector<std::vector<double>>& kernel);
+    // Winograd F(2x2, 3x3): each 2x2 block of outputs takes 16 multiplies instead of 36. Matches the direct
+    // loop to rounding (relative error around 1e-15 of the input range), not bit for bit.
+    static void correlateWinograd(const ImagePlane& in, ImagePlane& out, const std::vector<std::vector<double>>& kernel);
+    // Direct sum over a zero-padded copy of the input, one 4 x 8 block of outputs at a time: every input
+    // row of the block's window is loaded once and used for all four output rows it contributes to, with
+    // the partial sums held in registers. Zero taps are skipped as in the dense loop, but the sums are taken
+    // in a different order, so results match it to rounding only.
+    template <int Columns>
+    static void correlateBlocked(const ImagePlane& in, ImagePlane& out, const std::vector<std::vector<double>>& kernel,
+                                 int anchorX, int anchorY, ImagePlane& padded);
+    static void boxFilterPass(const IntegralImage& table, ImagePlane& out, int size);
+    static void recursiveGaussianColumns(ImagePlane& plane, double sigma);
+    static void transpose(const ImagePlane& in, ImagePlane& out);
+    static void correlateFFT(const ImagePlane& in, ImagePlane& out, const std::vector<std::vector<double>>& kernel,
+                             int anchorX, int anchorY, const Layout& layout);
+};
+
+template <int K, Convolution::Stencil<K> weights>
+void Convolution::correlateStencil(const ImagePlane& in, ImagePlane& out) {
+    constexpr int radius = K / 2;
+    const int width = in.width;
+    const int height = in.height;
+    out.resize(width, height);
+
+    ParallelUtils::forStrips(0, height, [&](std::size_t rowBegin, std::size_t rowEnd) {
+        for (int y = rowBegin; y < static_cast<int>(rowEnd); y++) {
+            double* outRow = out.row(y);
+            std::array<const double*, K> rows{};
+            for (int j = 0; j < K; j++) {
+                int yj = y + j - radius;
+                rows[j] = yj >= 0 && yj < height ? in.row(yj) : nullptr;
+            }
+            for (int x = 0; x < width; x++) {
+                // Same tap order and border handling as the dense loop, with the taps expanded at compile time
+                bool interior = x >= radius && x < width - radius;
+                double sum = 0.0;
+                [&]<int... taps>(std::integer_sequence<int, taps...>) {
+                    ([&] {
+                        constexpr int i = taps / K;
+                        constexpr int j = taps % K;
+                        if constexpr (weights[i][j] != 0.0) {
+                            int xi = x + i - radius;
+                            if (rows[j] && (interior || (xi >= 0 && xi < width))) {
+                                sum += rows[j][xi] * weights[i][j];
+                            }
+                        }
+                    }(), ...);
+                }(std::make_integer_sequence<int, K * K>{});
+                outRow[x] = sum;
+            }
+        }
+    }, 8);
+}
+
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "Convolution.hh"
+#include <string>
+#include <vector>
+
+// Picks the convolution algorithm for a shape class (image size, kernel size, number of non-zero taps,
+// separability, anchor), with the FFT transform size and the tile width of the blocked loop. By default the
+// cheapest candidate of the cost model is taken at its default sizes, a fixed rule, so the result of a blur
+// or a deconvolution does not depend on the machine. With tuning on, every plausible candidate instead runs
+// on a synthetic image of that size (the FFT at the smooth and the power of two size, the blocked loop at
+// each tile width) and the fastest one is kept; the algorithms round differently, so the output may then
+// change by rounding (a gray level after 8-bit truncation) from one machine or run to the next. Measured
+// plans can be written to a wisdom file tagged with the CPU, so later runs on the same machine reuse them
+// without measuring.
+//
+// The application turns tuning on when the LUCY_TUNING environment variable is 1, keeping the plans in
+// results/convolution.wisdom, or in the file LUCY_WISDOM names.
+class ConvolutionPlanner {
+public:
+    struct Plan {
+        Convolution::Algorithm algorithm = Convolution::Algorithm::DIRECT;
+        // Transform size of FFT and tile width of BLOCKED; 0 for the other algorithms
+        Convolution::Layout layout{};
+        // Measured time of the chosen algorithm, 0 when it comes from the cost model
+        double milliseconds = 0.0;
+    };
+
+    // Plan for correlating a width x height plane with kernel. Only the candidates listed are considered
+    // (all algorithms but WINOGRAD when empty); the ones the cost model puts more than three times above the
+    // cheapest are not measured. The measurement runs without holding the planner, so other shapes are
+    // planned meanwhile; two threads measuring the same shape keep the plan published first.
+    static Plan plan(int width, int height, const std::vector<std::vector<double>>& kernel, int anchorX, int anchorY,
+                     const std::vector<Convolution::Algorithm>& candidates = {});
+
+    // Wisdom file the measured plans are read from and written to; none by default, and an empty path goes
+    // back to keeping the plans in memory only
+    static void setWisdomFile(const std::string& path);
+
+    // Measure new shapes instead of taking the cheapest candidate of the cost model; off by default
+    static void setTuning(bool enabled);
+
+    // Drop every plan, in memory and on disk
+    static void forget();
+
+    // Settings of the application from the environment: tuning and the wisdom file as described above
+    static void configureFromEnvironment();
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Philox4x32-10 counter-based generator (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3").
+// Every output is a pure function of (seed, stream, index), so noise can be produced for any pixel in any
+// order, by any number of threads, and still be bit-identical for a given seed.
+class CounterRng {
+public:
+    explicit CounterRng(std::uint64_t seed) : key{static_cast<std::uint32_t>(seed), static_cast<std::uint32_t>(seed >> 32)} {}
+
+    // Four random words for the counter (index, stream, block)
+    std::array<std::uint32_t, 4> block(std::uint64_t index, std::uint32_t stream, std::uint32_t blockIndex = 0) const {
+        std::uint32_t c0 = static_cast<std::uint32_t>(index);
+        std::uint32_t c1 = static_cast<std::uint32_t>(index >> 32);
+        std::uint32_t c2 = stream;
+        std::uint32_t c3 = blockIndex;
+        std::uint32_t k0 = key[0];
+        std::uint32_t k1 = key[1];
+        for (int round = 0; round < 10; round++) {
+            std::uint64_t product0 = static_cast<std::uint64_t>(0xD2511F53u) * c0;
+            std::uint64_t product1 = static_cast<std::uint64_t>(0xCD9E8D57u) * c2;
+            std::uint32_t next0 = static_cast<std::uint32_t>(product1 >> 32) ^ c1 ^ k0;
+            std::uint32_t next2 = static_cast<std::uint32_t>(product0 >> 32) ^ c3 ^ k1;
+            c1 = static_cast<std::uint32_t>(product1);
+            c3 = static_cast<std::uint32_t>(product0);
+            c0 = next0;
+            c2 = next2;
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+        return {c0, c1, c2, c3};
+    }
+
+    // Map a random word to a uniform double in the open interval (0, 1)
+    static double toUniform(std::uint32_t word) {
+        return (static_cast<double>(word) + 0.5) * (1.0 / 4294967296.0);
+    }
+
+    // Uniforms number first .. first + count - 1 of a stream; uniform i is word i % 4 of block i / 4
+    void uniforms(std::uint64_t first, std::size_t count, std::uint32_t stream, double* out) const {
+        std::uint64_t index = first;
+        std::size_t written = 0;
+        while (written < count) {
+            std::array<std::uint32_t, 4> words = block(index / 4, stream);
+            for (std::uint64_t lane = index % 4; lane < 4 && written < count; lane++, index++) {
+                out[written++] = toUniform(words[lane]);
+            }
+        }
+    }
+
+    // Standard normals number first .. first + count - 1 of a stream, by Box-Muller over the uniforms of
+    // the same stream: normals 2k and 2k + 1 come from uniforms 2k and 2k + 1
+    void normals(std::uint64_t first, std::size_t count, std::uint32_t stream, double* out) const {
+        std::uint64_t pairBegin = first / 2;
+        std::uint64_t pairEnd = (first + count + 1) / 2;
+        std::size_t pairs = pairEnd - pairBegin;
+        std::vector<double> scratch(2 * pairs);
+        uniforms(2 * pairBegin, 2 * pairs, stream, scratch.data());
+
+        // Straight loop over the uniforms so the transform can be vectorized
+        for (std::size_t pair = 0; pair < pairs; pair++) {
+            double radius = std::sqrt(-2.0 * std::log(scratch[2 * pair]));
+            double angle = 2.0 * M_PI * scratch[2 * pair + 1];
+            scratch[2 * pair] = radius * std::cos(angle);
+            scratch[2 * pair + 1] = radius * std::sin(angle);
+        }
+        std::copy_n(scratch.data() + (first - 2 * pairBegin), count, out);
+    }
+
+    // Uniform random bit generator over one counter, for the standard distributions that consume
+    // a variable number of words per sample
+    class Stream {
+    public:
+        using result_type = std::uint32_t;
+
+        Stream(const CounterRng& rng, std::uint64_t index, std::uint32_t stream) : rng(rng), index(index), stream(stream) {}
+
+        static constexpr result_type min() { return 0; }
+        static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+        result_type operator()() {
+            if (lane == 4) {
+                words = rng.block(index, stream, blockIndex++);
+                lane = 0;
+            }
+            return words[lane++];
+        }
+
+    private:
+        const CounterRng& rng;
+        std::uint64_t index;
+        std::uint32_t stream;
+        std::uint32_t blockIndex = 0;
+        std::array<std::uint32_t, 4> words{};
+        int lane = 4;
+    };
+
+private:
+    std::array<std::uint32_t, 2> key;
+};
@@ -3,14 +3,41 @@
 //
 #pragma once
 #include "bitmap_image.hpp"
+#include "ImagePlane.hh"
+#include <complex>
+#include <vector>
 
 class DeconvolutionUtils {
 public:
     static void computeDifference(const bitmap_image& blurredImage, const bitmap_image& unblurredImage, bitmap_image& differenceImage);
 
     static void applyGrayscalePrior(bitmap_image &differenceImage);
-    static std::vector<std::vector<double>> computeGradientX(const std::vector<std::vector<double>>& image);
-    static std::vector<std::vector<double>> computeGradientY(const std::vector<std::vector<double>>& image);
+    static ImagePlane computeGradientX(const ImagePlane& image);
+    static ImagePlane computeGradientY(const ImagePlane& image);
+
+    // One sweep of the TV-regularized multiplicative update of deconvolveTV: with g the gradient of the
+    // estimate (same formulas as computeGradientX/Y, computed on the fly from three rows) and
+    // w = alpha / (|g| + lambda), correction becomes estimate * (correction + w * (estimate - correction)).
+    // Works in place on correction, row strips in parallel, without any intermediate image.
+    static void applyTVUpdate(const ImagePlane& estimate, ImagePlane& correction, double lambda, double alpha);
+
+    // Dual step of the primal-dual TV solver on a periodic plane: (dualX, dualY) += sigma * grad(primal), with
+    // forward differences wrapping around at the edges, then each pixel projected onto |p| <= lambda
+    static void applyDualTVStep(const ImagePlane& primal, ImagePlane& dualX, ImagePlane& dualY, double sigma,
+                                double lambda);
+
+    // Primal step input of the same solver: out = estimate + tau * div(dualX, dualY), with the divergence the
+    // negated adjoint of the wrapping forward differences. Written as complex values ready for the FFT.
+    static void applyDivergenceStep(const ImagePlane& estimate, const ImagePlane& dualX, const ImagePlane& dualY,
+                                    double tau, std::vector<std::complex<double>>& out);
+
+    // Split and dual updates of the ADMM solver, one pass on a periodic plane. With g the wrapping forward
+    // differences of estimate: the TV split z = shrink(g + dual, threshold) (vector soft threshold) and
+    // dual += g - z; the non-negativity split w = max(estimate + dualPositive, 0) and dualPositive +=
+    // estimate - w. The targets of the next x update, z - dual and w - dualPositive, go to the target planes.
+    static void applyADMMSplitStep(const ImagePlane& estimate, ImagePlane& dualX, ImagePlane& dualY,
+                                   ImagePlane& dualPositive, ImagePlane& targetX, ImagePlane& targetY,
+                                   ImagePlane& targetPositive, double threshold);
 
     };
 
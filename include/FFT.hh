@@ -0,0 +1,47 @@
+#pragma once
+
+#include <complex>
+#include <cstddef>
+#include <vector>
+
+// Mixed-radix complex FFT (Cooley-Tukey, decimation in time) for any length. Radix 4, 2, 3 and 5 butterflies
+// are specialised, other prime factors go through a generic butterfly, so lengths whose factors are
+// all small are the fast ones.
+class FFT {
+public:
+    explicit FFT(std::size_t size);
+
+    std::size_t size() const { return n; }
+    // In-place transforms; the inverse is not scaled
+    void forward(std::complex<double>* data) const;
+    void inverse(std::complex<double>* data) const;
+
+    // In-place 2D transform of a row-major width x height array; the inverse is scaled by 1 / (width * height)
+    static void transform2D(std::vector<std::complex<double>>& data, int width, int height, bool inverse);
+
+    static std::size_t nextPowerOfTwo(std::size_t n);
+
+    // True when n has no prime factor above 7
+    static bool isSmooth(std::size_t n);
+
+    // Relative time of a transform of length n, from per-point stage costs measured on 64 to 2048 points:
+    // 2 for a radix 4 stage, 3 for radix 2 and 3, 4 for radix 5, about 2.5 * radix for the generic butterfly
+    // of 7 and larger primes. A power of 4 comes to n log2 n.
+    static double estimatedCost(std::size_t n);
+
+    // Cheapest 2.3.5.7-smooth length of at least n by estimatedCost, never above nextPowerOfTwo(n)
+    static std::size_t nextFastSize(std::size_t n);
+
+private:
+    void transform(std::complex<double>* data, bool inverse) const;
+    void work(std::complex<double>* out, const std::complex<double>* in, std::size_t stride,
+              const std::size_t* factors, const std::vector<std::complex<double>>& twiddles, bool inverse) const;
+    void butterfly(std::complex<double>* out, std::size_t stride, std::size_t radix, std::size_t m,
+                   const std::vector<std::complex<double>>& twiddles, bool inverse) const;
+
+    std::size_t n;
+    // Pairs (radix, remaining length) for each stage
+    std::vector<std::size_t> factors;
+    std::vector<std::complex<double>> forwardTwiddles;
+    std::vector<std::complex<double>> inverseTwiddles;
+};
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "ImagePlane.hh"
+#include <string>
+#include <vector>
+
+// Image files the stages read into planes directly, for the inputs bitmap_image does not take: 8-bit (or
+// 1- and 4-bit) palettized or gray BMP, 32-bit BMP, 8- and 16-bit binary PGM and PPM, and plane files
+// (PlaneFile). A gray image gives a single plane and a color one red, green and blue planes, so a
+// monochrome source is processed once instead of as three equal channels. Samples are on the 0..255 scale
+// of the bitmaps whatever the bit depth, a 16-bit sample v becoming v * 255 / maxval without rounding.
+class ImageFile {
+public:
+    // Whether save writes the format of this path itself, in full precision (plane file, PGM, PPM), rather
+    // than it going out as a 24-bit bitmap
+    static bool isHighPrecision(const std::string& path);
+
+    // Read the planes of an image; a color image whose channels are all equal is read as one plane. false,
+    // with channels emptied, if the file is missing, damaged or of a kind not listed above (RLE BMP, text
+    // PNM, ...).
+    static bool load(const std::string& path, std::vector<ImagePlane>& channels);
+
+    // Write to a plane file, or to a 16-bit PGM (one plane) or PPM (one or three planes) with the samples
+    // clamped to 0..255 and rounded to the nearest of the 65536 levels; false if the file could not be
+    // written or the planes do not fit the format
+    static bool save(const std::string& path, const std::vector<ImagePlane>& channels);
+};
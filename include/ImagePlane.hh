@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Single-channel image of doubles stored row by row: pixel (x, y) is data[y * width + x]
+struct ImagePlane {
+    int width = 0;
+    int height = 0;
+    std::vector<double> data;
+
+    ImagePlane() = default;
+    ImagePlane(int width, int height, double value = 0.0)
+        : width(width), height(height), data(static_cast<std::size_t>(width) * height, value) {}
+
+    // Resize keeping the allocation when possible; the contents are unspecified afterwards
+    void resize(int newWidth, int newHeight) {
+        width = newWidth;
+        height = newHeight;
+        data.resize(static_cast<std::size_t>(width) * height);
+    }
+
+    std::size_t size() const { return data.size(); }
+    double* row(int y) { return data.data() + static_cast<std::size_t>(y) * width; }
+    const double* row(int y) const { return data.data() + static_cast<std::size_t>(y) * width; }
+    double& operator()(int x, int y) { return data[static_cast<std::size_t>(y) * width + x]; }
+    double operator()(int x, int y) const { return data[static_cast<std::size_t>(y) * width + x]; }
+};
@@ -4,12 +4,16 @@
 #include <gtk/gtk.h>
 #include <bitmap_image.hpp>
 #include "blur_image.hh"
+#include "deconvolution.hh"
 
 class ImageViewer {
     enum class DeconvolutionType {
         RICHARDSON_LUCY,
         RICHARDSON_LUCY_TV,
         RICHARDSON_LUCY_TIKHONOV,
+        WIENER,
+        PRIMAL_DUAL_TV,
+        ADMM,
     };
 public:
     ImageViewer();
@@ -54,6 +58,23 @@ private:
     static void iterationsChanged(GtkRange *range, gpointer data);
 
     static void saveImage(GtkWidget *widget, gpointer data);
+
+    // Region of interest selected by dragging over the blurred image; only that region is
+    // deconvolved again when the iterations or the deconvolution method change
+    GtkWidget* blurredEventBox;
+    bool selecting = false;
+    bool hasRegion = false;
+    int selectionStartX = 0, selectionStartY = 0;
+    int selectionEndX = 0, selectionEndY = 0;
+
+    static void runDeconvolution(Deconvolver &deconvolver, DeconvolutionType type, int iterations);
+    static void deconvolveRegion(ImageViewer *viewer);
+    static void showDeblurred(ImageViewer *viewer);
+    static void widgetToImage(ImageViewer *viewer, double widgetX, double widgetY, int &imageX, int &imageY);
+    static gboolean selectionPressed(GtkWidget *widget, GdkEventButton *event, gpointer data);
+    static gboolean selectionMoved(GtkWidget *widget, GdkEventMotion *event, gpointer data);
+    static gboolean selectionReleased(GtkWidget *widget, GdkEventButton *event, gpointer data);
+    static gboolean drawSelection(GtkWidget *widget, cairo_t *cr, gpointer data);
 };
 
 #endif  // IMAGE_VIEWER_H
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "ImagePlane.hh"
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// Summed-area table of an ImagePlane. Built once per image, it gives the sum of any axis-aligned box in
+// constant time, so box-based filters cost the same per pixel whatever their size.
+class IntegralImage {
+public:
+    IntegralImage() = default;
+    explicit IntegralImage(const ImagePlane& plane) { build(plane); }
+
+    void build(const ImagePlane& plane);
+
+    int width() const { return planeWidth; }
+    int height() const { return planeHeight; }
+
+    // Table entry (x, y): sum of the pixels in [0, x) x [0, y), for 0 <= x <= width and 0 <= y <= height
+    double at(int x, int y) const { return table[static_cast<std::size_t>(y) * (planeWidth + 1) + x]; }
+    const double* row(int y) const { return table.data() + static_cast<std::size_t>(y) * (planeWidth + 1); }
+
+    // Sum of the pixels in [x0, x1) x [y0, y1); the box is clipped to the image, so pixels outside count as zero
+    double sum(int x0, int y0, int x1, int y1) const {
+        x0 = std::clamp(x0, 0, planeWidth);
+        x1 = std::clamp(x1, 0, planeWidth);
+        y0 = std::clamp(y0, 0, planeHeight);
+        y1 = std::clamp(y1, 0, planeHeight);
+        if (x1 <= x0 || y1 <= y0) {
+            return 0.0;
+        }
+        return at(x1, y1) - at(x0, y1) - at(x1, y0) + at(x0, y0);
+    }
+
+private:
+    int planeWidth = 0;
+    int planeHeight = 0;
+    std::vector<double> table;
+};
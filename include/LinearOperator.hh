@@ -0,0 +1,96 @@
+#pragma once
+
+#include "Convolution.hh"
+#include "ImagePlane.hh"
+#include <array>
+#include <optional>
+#include <vector>
+
+// Blur operator the iterative solvers are written against: the forward model H, its adjoint H^T, and the
+// Richardson-Lucy correction H^T(numerator / (H x + offset)). A backend only has to provide forward and
+// adjoint; correction() composes them, and a backend that can do better overrides it.
+class LinearOperator {
+public:
+    virtual ~LinearOperator() = default;
+
+    // out = H x; out is resized to the size of x and may not alias it
+    virtual void forward(const ImagePlane& x, ImagePlane& out) = 0;
+
+    // out = H^T x; out is resized to the size of x and may not alias it
+    virtual void adjoint(const ImagePlane& x, ImagePlane& out) = 0;
+
+    // out = H^T(numerator / (H estimate + offset)), the offset plane being optional (the regularizer term of
+    // Tikhonov-RL). The ratio is taken pixel by pixel in that order, so 0 / 0 gives NaN as it always has.
+    virtual void correction(const ImagePlane& numerator, const ImagePlane& estimate, ImagePlane& out,
+                            const ImagePlane* offset = nullptr);
+
+    // The multiplicative Richardson-Lucy step: out = estimate * correction(numerator, estimate, offset).
+    // out may not alias estimate; the caller swaps them to take the step.
+    virtual void update(const ImagePlane& numerator, const ImagePlane& estimate, ImagePlane& out,
+                        const ImagePlane* offset = nullptr);
+
+protected:
+    // Scratch planes of the default correction(), kept across calls
+    ImagePlane blurred;
+    ImagePlane ratio;
+};
+
+// Correlation with a dense [x][y] kernel, as Convolution::correlate computes it, and with a second kernel for
+// the adjoint. The backend is any Convolution algorithm: AUTO lets the planner choose once, at construction,
+// among the local ones (sparse taps, direct, separable, register-blocked tiles); FFT and WINOGRAD are only
+// used when asked for, since a NaN ratio spreads over the whole plane or tile through them. The adjoint uses
+// the same backend unless given its own, which lets a run be rebuilt with the choices the planner made.
+//
+// With zeros outside the image, a local backend and a short kernel, correction() and update() are fused: the image is taken
+// in bands of rows, and for each band the blurred estimate and the ratio are computed only over the rows the
+// adjoint reads, into band-sized buffers, then correlated and written out (multiplied by the estimate for
+// update()). Neither the blurred estimate nor the ratio is ever stored at full size, which saves about half the
+// memory traffic of an iteration for the price of recomputing the kernel halo rows of each band. Every pixel
+// sees the same sums in the same order as the unfused path, so results are identical.
+class ConvolutionOperator : public LinearOperator {
+public:
+    ConvolutionOperator(const std::vector<std::vector<double>>& kernel, int anchorX, int anchorY,
+                        const std::vector<std::vector<double>>& adjointKernel, int adjointAnchorX, int adjointAnchorY,
+                        int width, int height, Convolution::Algorithm backend = Convolution::Algorithm::AUTO,
+                        Convolution::Boundary boundary = Convolution::Boundary::ZERO,
+                        std::optional<Convolution::Algorithm> adjointBackend = std::nullopt);
+
+    void forward(const ImagePlane& x, ImagePlane& out) override;
+    void adjoint(const ImagePlane& x, ImagePlane& out) override;
+    void correction(const ImagePlane& numerator, const ImagePlane& estimate, ImagePlane& out,
+                    const ImagePlane* offset = nullptr) override;
+    void update(const ImagePlane& numerator, const ImagePlane& estimate, ImagePlane& out,
+                const ImagePlane* offset = nullptr) override;
+
+    Convolution::Algorithm forwardAlgorithm() const { return forwardPass.algorithm; }
+    Convolution::Algorithm adjointAlgorithm() const { return adjointPass.algorithm; }
+
+private:
+    struct Pass {
+        std::vector<std::vector<double>> kernel;
+        int anchorX = 0;
+        int anchorY = 0;
+        Convolution::Algorithm algorithm = Convolution::Algorithm::DIRECT;
+        Convolution::Layout layout{};
+    };
+
+    Pass makePass(const std::vector<std::vector<double>>& kernel, int anchorX, int anchorY, int width, int height,
+                  Convolution::Algorithm backend) const;
+    void apply(const Pass& pass, const ImagePlane& x, ImagePlane& out, Convolution::Workspace& scratch) const;
+    // Rows per band of the fused passes for an image of this width, 0 when they do not apply: they need zeros
+    // outside the image, non-empty kernels, a backend that computes each output from its neighbourhood alone
+    // (not FFT or WINOGRAD, whose transforms depend on the tiling), and kernels short enough for the bands
+    int fusedBandRows(int width) const;
+    void fusedCorrection(const ImagePlane& numerator, const ImagePlane& estimate, ImagePlane& out,
+                         const ImagePlane* offset, int bandRows, bool multiply);
+
+    Convolution::Boundary boundary;
+    Pass forwardPass;
+    Pass adjointPass;
+    // Scratch planes of the passes run on the whole image
+    Convolution::Workspace workspace;
+    // Estimate rows, blurred rows, ratio rows and correction rows of a band, and the scratch planes of its
+    // passes
+    std::vector<std::array<ImagePlane, 4>> bandBuffers;
+    std::vector<Convolution::Workspace> bandWorkspaces;
+};
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+class ParallelUtils {
+public:
+    // Number of threads used by the parallel loops, defaults to the number of hardware threads
+    static unsigned int threadCount();
+    static void setThreadCount(unsigned int count);
+
+    // Split [begin, end) into contiguous strips of at least minStrip items and run body(stripBegin, stripEnd)
+    // on each strip concurrently. Returns once every strip is done. Called from inside a strip, the loop runs
+    // in the calling thread, so nested loops do not multiply the number of threads. The worker threads are
+    // kept between calls. If body throws, the other strips still run and the first exception is rethrown
+    // in the calling thread once they are done.
+    static void forStrips(std::size_t begin, std::size_t end,
+                          const std::function<void(std::size_t, std::size_t)>& body, std::size_t minStrip = 1);
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "bitmap_image.hpp"
+#include "ImagePlane.hh"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Floating-point image file the pipeline stages exchange instead of 24-bit BMP, so that a blurred image or
+// a deconvolution result is passed on without rounding to 8 bits. Samples keep the 0..255 scale of the
+// bitmaps and are stored as float32, or float16 for half the size (11 significant bits: about 0.1 gray level
+// of error at the top of the range).
+//
+// Layout, native byte order: a 32-byte header (magic "LPLF", then version, width, height, channels,
+// tileSize, bits per sample and a zero word, as 32-bit integers), then the channels one after the other,
+// each as tileSize x tileSize tiles in row-major tile order, each tile row by row. Edge tiles are padded
+// to the full size, so sample (x, y) of channel c sits at a fixed offset
+//   32 + (((c * tilesY + y / tileSize) * tilesX + x / tileSize) * tileSize * tileSize
+//         + (y % tileSize) * tileSize + x % tileSize) * bytesPerSample
+// and a mapped file can be read tile by tile.
+class PlaneFile {
+public:
+    enum class Format { FLOAT32, FLOAT16 };
+
+    static constexpr const char* extension = ".lpf";
+    static constexpr int defaultTileSize = 64;
+
+    // Whether a path names a plane file, by its extension
+    static bool isPlaneFile(const std::string& path);
+
+    // Write all channels, which must have the same size, with tileSize clamped to 1..4096; false if the file
+    // could not be written
+    static bool save(const std::string& path, const std::vector<ImagePlane>& channels,
+                     Format format = Format::FLOAT32, int tileSize = defaultTileSize);
+
+    // Read all channels; false, with channels emptied, if the file is missing, truncated, not a plane file,
+    // or its header does not describe exactly the samples it holds
+    static bool load(const std::string& path, std::vector<ImagePlane>& channels);
+
+    // Red, green and blue planes of a bitmap, or a single plane if it is gray, and back with the stages'
+    // truncation to 0..255. A single channel becomes a gray bitmap.
+    static std::vector<ImagePlane> fromBitmap(const bitmap_image& image);
+    static bitmap_image toBitmap(const std::vector<ImagePlane>& channels);
+
+    // Whether toBitmap(channels) would give this bitmap: a stage holding both uses its channels only while
+    // nothing has changed the bitmap behind them
+    static bool matches(const std::vector<ImagePlane>& channels, const bitmap_image& image);
+
+    // IEEE 754 half precision, rounded to nearest even; infinities and NaN are kept
+    static std::uint16_t toHalf(float value);
+    static float fromHalf(std::uint16_t half);
+};
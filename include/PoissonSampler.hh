@@ -0,0 +1,37 @@
+#pragma once
+
+#include "CounterRng.hh"
+#include <array>
+#include <vector>
+
+// Poisson noise for 8-bit intensities. An intensity v is treated as v * photonScale expected photons and the
+// noisy photon count is mapped back to v units. Since there are only 256 possible means, a sampler is built
+// once per intensity: an inverse-CDF table for small means and Hormann's transformed rejection (PTRS) for
+// large ones.
+class PoissonSampler {
+public:
+    explicit PoissonSampler(double photonScale = 1.0);
+
+    // True when samples for this intensity only need the single uniform passed to sampleFromTable
+    bool usesTable(unsigned char value) const { return samplers[value].table; }
+    unsigned char sampleFromTable(unsigned char value, double uniform) const;
+    unsigned char sampleByRejection(unsigned char value, CounterRng::Stream& generator) const;
+
+private:
+    // Below this mean the inverse-CDF table is short and PTRS is not valid
+    static constexpr double tableLimit = 10.0;
+
+    struct Sampler {
+        bool table = true;
+        // Inverse CDF: the sample is outputs[k] for the first k with cdf[k] > u
+        std::vector<double> cdf;
+        std::vector<unsigned char> outputs;
+        // PTRS constants
+        double mean = 0.0, logMean = 0.0, b = 0.0, a = 0.0, logInvAlpha = 0.0, vr = 0.0;
+    };
+
+    unsigned char toIntensity(double photons) const;
+
+    double photonScale;
+    std::array<Sampler, 256> samplers;
+};
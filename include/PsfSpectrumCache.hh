@@ -0,0 +1,54 @@
+#pragma once
+
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Cache of point spread function spectra, so a batch of frames blurred by the same few kernels pays for
+// each transform once. Entries are keyed by a hash of the kernel contents, the anchor and the padded
+// transform size, and kept in memory up to a byte budget (least recently used first out). With a disk
+// directory set, forward spectra are also stored there and survive the process.
+class PsfSpectrumCache {
+public:
+    using Spectrum = std::vector<std::complex<double>>;
+
+    struct Metrics {
+        std::size_t memoryHits = 0;
+        std::size_t diskHits = 0;
+        std::size_t misses = 0;
+
+        double hitRate() const {
+            std::size_t lookups = memoryHits + diskHits + misses;
+            return lookups == 0 ? 0.0 : static_cast<double>(memoryHits + diskHits) / lookups;
+        }
+    };
+
+    // Row-major paddedWidth x paddedHeight spectrum of the [x][y] kernel, which multiplies a padded image
+    // spectrum to correlate it with the kernel the way Convolution::correlate does. An adjoint pass caches
+    // the spectrum of its flipped kernel; the frequency domain solvers take conj(H) inline.
+    static std::shared_ptr<const Spectrum> spectrum(const std::vector<std::vector<double>>& kernel, int anchorX,
+                                                    int anchorY, int paddedWidth, int paddedHeight);
+
+    // Spectrum of the centred 3x3 Laplacian, the regularizer of the Tikhonov modes
+    static std::shared_ptr<const Spectrum> laplacianSpectrum(int paddedWidth, int paddedHeight);
+
+    // Directory of the on-disk store; empty (the default) keeps spectra in memory only
+    static void setDiskDirectory(const std::string& path);
+
+    // Memory budget in bytes, 256 MiB by default
+    static void setCapacity(std::size_t bytes);
+
+    // Lookups since the start of the process or the last resetMetrics(). Two threads missing the same
+    // spectrum at once both count, even though only the first one stored is kept.
+    static Metrics metrics();
+    static void resetMetrics();
+
+    // Drop the in-memory entries; the disk store is left alone
+    static void clear();
+
+    // 64-bit FNV-1a hash of the kernel size and contents
+    static std::uint64_t hashKernel(const std::vector<std::vector<double>>& kernel);
+};
@@ -7,16 +7,27 @@
 #include <map>
 #include <random>
 #include <string>
+#include <cstdint>
+#include "Convolution.hh"
+#include "CounterRng.hh"
+#include "ImagePlane.hh"
 
 
 
 class ImageBlurrer {
 public:
-    enum BlurType { GAUSSIAN, BOX, MOTION, BLUR_NONE};
+    // MOTION_SUBPIXEL rasterizes the motion line with bilinear weights instead of whole pixels.
+    // GAUSSIAN_RECURSIVE blurs with a recursive filter whose cost does not grow with sigma, for large
+    // defocus; its kernel is widened to cover +/- 3 sigma.
+    enum BlurType { GAUSSIAN, BOX, MOTION, MOTION_SUBPIXEL, GAUSSIAN_RECURSIVE, BLUR_NONE};
     enum NoiseType { SALT_AND_PEPPER, GAUSS, POISSON, SPECKLE, NOISE_NONE};
 
     ImageBlurrer(BlurType type, int kernelSize, double sigma = 0.0, double angle = 0.0);
 
+    // The formats of ImageFile (plane files, gray and 32-bit BMP, 16-bit PGM/PPM) are read and written in
+    // full precision: blurImage starts from the loaded channels and its unrounded result is what gets saved,
+    // as long as no 8-bit operation (noise, denoising) has changed the image in between. A gray image is
+    // blurred as a single channel.
     void loadImage(const std::string& filePath);
     void loadImage(const bitmap_image& image);
     void saveImage(const std::string& filePath);
@@ -27,29 +38,57 @@ public:
         std::vector<double>& redNeighborhood, std::vector<double>& greenNeighborhood, std::vector<double>& blueNeighborhood);
     std::vector<std::vector<double>> getKernel() { return kernel; }
 
+    // Repeat a BOX blur passes times, a cheap approximation of a Gaussian. The kernel becomes the
+    // composite of the passes, so the box size must be odd when passes > 1.
+    void setBoxPasses(int passes);
+
     void addNoise(double mean, double stddev, NoiseType type);
 
+    // Poisson (shot) noise where an intensity v stands for v * photonScale photons: scales below 1
+    // simulate short exposures, larger ones long exposures
+    void addPoissonNoise(double photonScale);
+
+    // Seed of the noise generators; the same seed gives the same noise at any thread count
+    void setSeed(std::uint64_t seed);
+
 private:
+    BlurType blurType;
     int kernelSize;
+    double sigma;
+    int boxSize;
+    int boxPasses = 1;
     bitmap_image image;
     std::vector<std::vector<double>> kernel;
+    std::uint64_t seed = std::random_device{}();
+
+    // The image in full precision, red first or a single gray plane, from a loaded file or the last
+    // blurImage; only used while image still matches it
+    std::vector<ImagePlane> exactChannels;
+
+    // Work buffers of blurImage, kept between calls
+    std::vector<ImagePlane> channelPlanes;
+    ImagePlane blurredPlane;
+    Convolution::Workspace workspace;
 
     void createGaussianKernel(double sigma);
-    void createBoxBlurKernel(int size);
+    void createBoxBlurKernel(int size, int passes);
     void createMotionBlurKernel(int size, double angle);
+    void createSubpixelMotionBlurKernel(int size, double angle);
 
     void addGaussianNoise(double mean, double stddev);
 
     void addSaltAndPepperNoise(double mean, double stddev);
 
-    void addPoissonNoise();
-
-
     void addSpeckleNoise(double stddev);
 
     void createIdentityKernel(int kernelSize);
 
-    unsigned char addPoissonNoiseToChannel(unsigned char value, std::mt19937 &gen);
+    // Median filters behind denoiseImage: sorting networks for 3x3 and 5x5 windows, constant-time
+    // histograms for larger ones. Both write into output, a bitmap the size of the image. Count is the type
+    // of the window histogram, which must hold (2 * radius + 1)^2.
+    void medianFilterNetwork(int radius, bitmap_image& output);
+    template <typename Count>
+    void medianFilterHistogram(int radius, bitmap_image& output);
 };
 
 
@@ -1,8 +1,22 @@
 #pragma once
 
 #include "bitmap_image.hpp"
+#include "Checkpoint.hh"
+#include "Convolution.hh"
+#include "ImagePlane.hh"
+#include "LinearOperator.hh"
+#include "PsfSpectrumCache.hh"
 #include <vector>
+#include <chrono>
 #include <cmath>
+#include <complex>
+#include <deque>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
 
 class Deconvolver {
 public:
@@ -13,11 +27,12 @@ public:
 
     Deconvolver(const std::vector<std::vector<double>> &kernel, const std::string &filePath);
 
-// Load the image
+    // Load the image; the formats of ImageFile (plane files, gray and 32-bit BMP, 16-bit PGM/PPM) are read in
+    // full precision, with one channel for a gray image
     void loadImage(const std::string& filePath);
     void loadImaged(const bitmap_image& image);
 
-        // Save the image
+    // Save the image; to a plane file, PGM or PPM, the result of the last method is written unrounded
     void saveImage(const std::string& filePath);
     // Perform deconvolution
     bitmap_image getImage() { return image; }
@@ -25,12 +40,197 @@ public:
     void deconvolveAuto(int iterations, double lambda);
     // Compute the difference between the original and deconvolved image
     void deconvolveTV(int iterations, double lambda, double alpha, double scalingFactor);
+    // One-shot Wiener/Tikhonov deconvolution in the frequency domain: x = conj(H) y / (|H|^2 + lambda |L|^2),
+    // with H the kernel and L the Laplacian spectrum. One forward and one inverse FFT per channel; the image
+    // is padded to a fast transform size following the boundary mode, TAPER giving the least edge ringing.
+    // Every pixel depends on the whole plane, so under deconvolveRegion the crop only approximates a full run.
+    void deconvolveWiener(double lambda);
 
+    // Convergence of an iterative solver on one channel: iterations run, and the relative change
+    // |x_k - x_(k-1)| / |x_k| of each iteration
+    struct Convergence {
+        int iterations = 0;
+        std::vector<double> history;
+
+        double relativeChange() const { return history.empty() ? 0.0 : history.back(); }
+    };
+
+    // Total variation deconvolution by the Chambolle-Pock primal-dual algorithm, minimizing
+    // 1/2 |Hx - y|^2 + lambda TV(x) on the same padded periodic plane as deconvolveWiener. The data term is
+    // solved exactly in the frequency domain (one forward and one inverse FFT per iteration), the TV term
+    // through its dual, projected pixel by pixel. Stops after maxIterations or once the relative change
+    // falls below tolerance; returns the convergence of each channel. lambda is in 8-bit gray levels.
+    std::vector<Convergence> deconvolvePrimalDual(int maxIterations, double lambda, double tolerance = 1e-4);
+
+    // ADMM deconvolution minimizing 1/2 |Hx - y|^2 + mu/2 |Lx|^2 + lambda TV(x) subject to x >= 0, with L the
+    // Laplacian of deconvolveAuto. The splits z = grad x and w = x make the x update a single division in
+    // the frequency domain (one FFT pair per iteration); the TV split is a vector shrinkage and the
+    // non-negativity one a clamp, fused with the dual updates in one pass. Same stopping rule, plane and
+    // lambda units as deconvolvePrimalDual. Under the ZERO boundary the constraint keeps the margin from
+    // going negative to cancel blur spilled past the edge, which darkens the outermost pixels instead;
+    // MIRROR or TAPER avoid that.
+    std::vector<Convergence> deconvolveADMM(int maxIterations, double lambda, double mu, double tolerance = 1e-4);
+
+    // Outcome of deconvolveWithin: iterations completed, time of the last one over all channels, and the
+    // time spent in the call
+    struct TimedRun {
+        int iterations = 0;
+        double iterationMilliseconds = 0.0;
+        double elapsedMilliseconds = 0.0;
+    };
+
+    // Plain RL (as deconvolve) for as long as the budget allows instead of a fixed number of iterations.
+    // Before each iteration the time of the previous one is taken as the cost of the next, and the run stops
+    // with the current estimate if it would end past the deadline. The first iteration is the measurement and
+    // runs unless the setup (kernel planning, channel split) already used up the budget; a budget of zero or
+    // less leaves the image untouched. The final conversion counts against the budget too, so a run may end
+    // past the deadline by about one iteration at worst.
+    TimedRun deconvolveWithin(std::chrono::milliseconds budget, int maxIterations = std::numeric_limits<int>::max());
+
+    // Per channel record of deconvolveActiveSet: the fraction of the image recomputed at each iteration
+    struct ActiveSet {
+        std::vector<double> activeFraction;
+
+        double meanFraction() const {
+            double sum = 0.0;
+            for (double fraction : activeFraction) {
+                sum += fraction;
+            }
+            return activeFraction.empty() ? 0.0 : sum / activeFraction.size();
+        }
+    };
+
+    // Plain RL (as deconvolve) restricted to the tiles still changing. The image is cut into tileSize square
+    // tiles; each iteration updates the active ones, span by span along the tile rows, from a crop extended
+    // by the one-iteration halo, and records the largest change of each tile in gray levels. A tile is then
+    // frozen while no tile within the halo changed by threshold or more, and woken up again as soon as one
+    // does, since its inputs moved. With threshold 0 every tile stays active and the result is that of
+    // deconvolve. Returns, per channel, the fraction of the pixels updated at each iteration (the halo reads
+    // of the crops come on top).
+    std::vector<ActiveSet> deconvolveActiveSet(int iterations, double threshold, int tileSize = 64);
+
+    // Convolution backend of the RL methods. AUTO (the default) lets the planner pick among the local
+    // algorithms; FFT is accepted but spreads any NaN ratio (0 / 0 on black pixels) over the whole channel.
+    void setBackend(Convolution::Algorithm backend) { this->backend = backend; }
+
+    // Start the RL methods from the Wiener estimate with this lambda instead of the blurred image, taken with
+    // the folded kernel the RL methods blur with rather than the centred one of deconvolveWiener. This does
+    // not speed them up: their ratio is the estimate over its own blur, not the blurred image over it, so
+    // nothing pulls the iterations back to the data and they sharpen whatever they start from. Compared
+    // with the original at the best alignment, the start is up to 0.7 dB better, one iteration leaves it
+    // between 0.4 dB below and 0.7 dB above the usual run, and from the third it is behind.
+    void setWienerStart(double lambda) { wienerStart = lambda; }
+    void clearWienerStart() { wienerStart.reset(); }
+
+    // Save the state of the RL methods (deconvolve, deconvolveAuto, deconvolveTV) to path
+    // every interval iterations: the estimate in full precision, the iteration reached and the parameters of
+    // the run. The snapshot is copied between two iterations and written by a background thread, so the
+    // iterations do not wait for the disk; a checkpoint falling due while the previous one is still being
+    // written is skipped. The method returns once the last write is done.
+    void setCheckpoint(const std::string& path, int interval) {
+        checkpointPath = path;
+        checkpointInterval = interval;
+    }
+    void clearCheckpoint() { checkpointInterval = 0; }
+
+    // Whether the last checkpoint the last RL run wrote failed to reach the disk. The file at the checkpoint
+    // path is then the one written before it, if any, and does not hold the latest state.
+    bool lastCheckpointFailed() const { return checkpointFailed; }
+
+    // Continue the RL run saved at path up to the iteration count it was started with, with the same method,
+    // parameters, boundary and backends, so the result is bit for bit that of an uninterrupted run. The
+    // Deconvolver must hold the same kernel and an image of the same size and number of channels (its pixels
+    // are not used otherwise). Keeps checkpointing if setCheckpoint is on. false, with nothing done, if the
+    // file is missing, damaged or does not match.
+    bool resume(const std::string& path);
+
+    // Deconvolve only the rectangle (x, y, width, height) and return the crop. The region is fetched
+    // together with a halo wide enough for every pixel of the crop to see the same neighbourhood as in
+    // a full-frame run; `method` runs the chosen deconvolution on a Deconvolver holding that haloed region.
+    // Only the RL methods are local: the Wiener, primal-dual and ADMM solvers, and a Wiener start, depend
+    // on the whole image, so for them no halo makes the crop match a full run.
+    bitmap_image deconvolveRegion(unsigned int x, unsigned int y, unsigned int width, unsigned int height,
+                                  int iterations, const std::function<void(Deconvolver&)>& method);
+    bitmap_image deconvolveRegion(unsigned int x, unsigned int y, unsigned int width, unsigned int height,
+                                  int iterations);
+    // Number of pixels a region must be extended by on each side for `iterations` iterations of the RL methods
+    unsigned int regionHalo(int iterations) const;
+
+    // What the kernel reads outside the image; ZERO, the historical behaviour, by default. MIRROR, REPLICATE
+    // and TAPER avoid the dark ring zeros leave along the borders.
+    void setBoundary(Convolution::Boundary boundary) { this->boundary = boundary; }
 
     bitmap_image image;
 private:
     std::vector<std::vector<double>> kernel;
-    std::vector<std::vector<double>> convolve(const std::vector<std::vector<double>>& image, const std::vector<std::vector<double>>& kernel);
+    // The image in full precision, from a plane file or the last method; only used while image still
+    // matches it, so a bitmap assigned or loaded since takes over
+    std::vector<ImagePlane> exactChannels;
+    Convolution::Boundary boundary = Convolution::Boundary::ZERO;
+    Convolution::Algorithm backend = Convolution::Algorithm::AUTO;
+    std::optional<double> wienerStart;
+    std::string checkpointPath;
+    int checkpointInterval = 0;
+    // Checkpoint being written in the background, if any, and whether the last one written failed
+    std::future<bool> pendingCheckpoint;
+    bool checkpointFailed = false;
+    // Scratch buffers shared by every method and reused from one iteration, channel and call to the next,
+    // so the loops do not allocate. Contents are unspecified when handed out.
+    struct Workspace {
+        // Planes are kept in a deque so references to earlier ones stay valid as more are added
+        std::deque<ImagePlane> planes;
+        std::deque<std::vector<std::complex<double>>> spectra;
+
+        ImagePlane& plane(std::size_t index, int width, int height);
+        std::vector<std::complex<double>>& spectrum(std::size_t index, std::size_t size);
+    };
+    Workspace workspace;
+
+    // Blur operator of the RL methods for width x height channels, with the backend of each pass and the
+    // boundary mode (the configured one, or that of a resumed run)
+    std::unique_ptr<ConvolutionOperator> blurOperator(int width, int height, Convolution::Algorithm forwardBackend,
+                                                      Convolution::Algorithm adjointBackend,
+                                                      Convolution::Boundary boundary) const;
+
+    // The RL iteration shared by deconvolve, deconvolveAuto and deconvolveTV, which only differ in the
+    // regularizer: none, the Laplacian added to the blurred estimate, or the TV weighting of the update
+    enum class Regularization { NONE, TIKHONOV, TV };
+    // With a deadline, stops between two iterations once the next is predicted to end past it
+    TimedRun richardsonLucy(int iterations, Regularization regularization, double lambda, double alpha,
+                            double scalingFactor,
+                            std::optional<std::chrono::steady_clock::time_point> deadline = std::nullopt);
+    // The iterations themselves, from the state of a new or resumed run, checkpointing as configured
+    TimedRun richardsonLucy(Checkpoint& state, LinearOperator& blur,
+                            std::optional<std::chrono::steady_clock::time_point> deadline);
+    static std::vector<std::vector<double>> foldKernel(const std::vector<std::vector<double>>& kernel);
+    static std::vector<std::vector<double>> flipKernel(const std::vector<std::vector<double>>& kernel);
+
+    // Periodic plane the frequency-domain methods work on: the observed channel padded to a fast transform
+    // size following the boundary mode, with the kernel and Laplacian spectra at that size. The kernel is
+    // the centred one of ImageBlurrer, or with foldedModel the folded one the RL methods apply.
+    struct FrequencyDomain {
+        int left = 0;
+        int top = 0;
+        int paddedWidth = 0;
+        int paddedHeight = 0;
+        ImagePlane observed;
+        std::shared_ptr<const PsfSpectrumCache::Spectrum> psf;
+        std::shared_ptr<const PsfSpectrumCache::Spectrum> laplacian;
+
+        // The width x height image part of a padded plane
+        ImagePlane crop(const ImagePlane& padded, int width, int height) const;
+    };
+    FrequencyDomain frequencyDomain(const ImagePlane& observed, bool foldedModel = false) const;
+    ImagePlane wienerEstimate(const ImagePlane& observed, double lambda, bool foldedModel = false) const;
+    Convergence primalDualTV(ImagePlane& channel, int maxIterations, double lambda, double tolerance);
+    Convergence admm(ImagePlane& channel, int maxIterations, double lambda, double mu, double tolerance);
+
+    // Red, green and blue planes of the image, or one plane if it is gray, in full precision when available,
+    // and back
+    std::vector<ImagePlane> splitChannels() const;
+    // Starting estimate of the RL methods: the channels, or their Wiener estimate clamped to non-negative
+    std::vector<ImagePlane> initialEstimate() const;
+    void mergeChannels(const std::vector<ImagePlane>& channels, double scalingFactor);
 
 };
 
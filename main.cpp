@@ -1,7 +1,20 @@
+#include "ConvolutionPlanner.hh"
 #include "ImageViewer.hh"
+#include "PsfSpectrumCache.hh"
+#include <iostream>
 
 int main(int argc, char* argv[]) {
+    // LUCY_TUNING=1 measures the convolution algorithms and keeps the plans for the next runs
+    ConvolutionPlanner::configureFromEnvironment();
     ImageViewer viewer;
     viewer.run(argc, argv);
+
+    // How often the FFT paths found their kernel spectrum already computed
+    PsfSpectrumCache::Metrics cache = PsfSpectrumCache::metrics();
+    if (cache.memoryHits + cache.diskHits + cache.misses > 0) {
+        std::cerr << "PSF spectrum cache: " << cache.memoryHits << " memory hits, " << cache.diskHits
+                  << " disk hits, " << cache.misses << " misses (" << 100.0 * cache.hitRate() << "% hit rate)"
+                  << std::endl;
+    }
     return 0;
 }